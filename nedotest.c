@@ -1,5 +1,9 @@
 /* vim: set et sts=4 sw=4: */
 
+#ifdef __unix__
+#define _GNU_SOURCE     /* strsignal, RUSAGE_THREAD... */
+#endif
+
 #ifdef __cplusplus
 #include <cstddef>      // std::max_align_t
 #include <alloca.h>
@@ -16,9 +20,30 @@
 #include <string.h>
 #include <setjmp.h>
 #include <limits.h>
+#include <time.h>
 
 #ifdef __unix__
 #include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#if defined(__has_include)
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define HAVE_BACKTRACE 1
+#endif
+#if __has_include(<stdio_ext.h>)
+#include <stdio_ext.h>
+#define HAVE_FPENDING 1
+#endif
+#endif
+#endif
+
+#if __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
 #endif
 
 #include "nedotest.h"
@@ -29,31 +54,504 @@
     ( (void)sizeof(0 ? (ptr) : &((type *)0)->member), \
       (type *)((char*)(ptr) - offsetof(type, member)) )
 
+#ifdef __cplusplus
+#define _Thread_local thread_local
+#define _Alignas alignas
+#define _Alignof alignof
+#define max_align_t std::max_align_t
+#endif
+
 enum { MAX_STRING_LEN = 70 };
 
 const char *argv0;
-static FILE *out;
 static int verbose;
+static unsigned jobs = 1;
+static int isolate;
+static unsigned fork_batch;    /* tests per worker process, 0 -- unlimited */
+static const char *state_file;
+static unsigned durations;     /* number of slowest tests to report */
+static double timeout;          /* default timeout of the tests in seconds */
+static int bench;               /* run benchmarks in place of the tests */
+static unsigned bench_reps = 10;    /* repetitions of each benchmark */
+static double bench_time = 0.05;    /* minimal time of one repetition, seconds */
+static unsigned shard_index, shard_count;   /* run only one shard of the tests */
+static int list;                /* list the tests in place of running */
+static int failed_first;        /* run tests failed in previous run first */
+static int last_failed;         /* run only tests failed in previous run */
+static int catch_crashes;       /* crash of the test is reported as failure */
+static unsigned long repeat;    /* repeat the tests N times */
+static int until_fail;          /* repeat the tests until failure */
+static unsigned stress_threads = 1; /* run each test in N threads at once */
+int _nt_count_hits;             /* count executions of the assertions */
+
+/* Output of the test runner is collected in the buffer of each thread (the
+ * sink) and written at once at the end of each test, so the test costs a
+ * single system call rather than one call per line of the output. */
+struct sink {
+    char *buf;
+    size_t len, size;
+    int fd;     /* file to write the buffer, or -1 if the buffer is taken by the runner */
+    FILE *file; /* stream of the same file (used where write() isn't available) */
+    size_t head;    /* text which must precede the output of the test to stdout */
+};
+
+enum { SINK_SIZE = 4096 };
+
+/* Sink of the current thread: it writes to stdout for sequential run, or
+ * collects output of the test in the worker thread (or worker process), and
+ * the output is passed to the test runner after the test is finished. */
+static _Thread_local struct sink *out;
+
+/* Text output of the main thread: stdout, or stderr if the report is printed to stdout. */
+static struct sink text_sink = {NULL, 0, 0, -1, NULL, 0};
+
+#define SINK_PRINTF(sink, ...) (0 ? (void)printf(__VA_ARGS__) : _printf_sink(sink, __VA_ARGS__))
+
+#ifdef __unix__
+static int write_all(int fd, const void *data, size_t size)
+{
+    while (size) {
+        ssize_t len = write(fd, data, size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        data = (const char*)data + len, size -= len;
+    }
+    return 0;
+}
+#endif
+
+/* Write the buffer to the file (if any), stdout buffer is flushed first,
+ * so the output of printf() done before isn't reordered. */
+static void sink_flush(struct sink *thiz)
+{
+    if (thiz->fd < 0 || !thiz->len)
+        return;
+
+    size_t head = 0;
+#ifdef HAVE_FPENDING
+    if (thiz->head && thiz->head <= thiz->len && __fpending(stdout))
+        head = thiz->head, write_all(thiz->fd, thiz->buf, head);
+#endif
+    thiz->head = 0;
+
+    fflush(stdout);
+#ifdef __unix__
+    write_all(thiz->fd, thiz->buf + head, thiz->len - head);
+#else
+    fwrite(thiz->buf, 1, thiz->len, thiz->file);
+    fflush(thiz->file);
+#endif
+    thiz->len = 0;
+}
+
+/* Text in the sink must be printed before the output, which the test prints
+ * to stdout itself. If stdout is buffered, the text is kept in the sink and
+ * written before the buffer of stdout only if the test has printed something
+ * there, so the test which prints nothing costs a single write. */
+static void sink_hold(struct sink *thiz)
+{
+    if (thiz->fd < 0 || thiz->file != stdout)
+        return;
+
+#ifdef HAVE_FPENDING
+    static int tty = -1;
+    if (tty < 0)
+        tty = isatty(fileno(stdout));
+
+    /* buffer of stdout might be not allocated yet, its size is 0 then */
+    if (!tty && !__flbf(stdout) && __fbufsize(stdout) != 1) {
+        thiz->head = thiz->len;
+        return;
+    }
+#endif
+    sink_flush(thiz);
+}
+
+/* Reserve space for `len` characters and terminating zero. */
+static void sink_reserve(struct sink *thiz, size_t len)
+{
+    if (thiz->size - thiz->len > len)
+        return;
+
+    sink_flush(thiz);
+
+    size_t size = thiz->size ? thiz->size : SINK_SIZE;
+    while (size - thiz->len <= len)
+        size *= 2;
+
+    if (size != thiz->size) {
+        char *buf = (char*)realloc(thiz->buf, size);
+        if (!buf) abort();
+        thiz->buf = buf, thiz->size = size;
+    }
+}
+
+static void _printf_sink(struct sink *thiz, const char *fmt, ...)
+{
+    va_list args, copy;
+    va_start(args, fmt);
+    va_copy(copy, args);
+
+    int len = vsnprintf(thiz->buf ? &thiz->buf[thiz->len] : NULL, thiz->size - thiz->len, fmt, args);
+    if (len >= 0 && (size_t)len >= thiz->size - thiz->len) {
+        sink_reserve(thiz, len);
+        len = vsnprintf(&thiz->buf[thiz->len], thiz->size - thiz->len, fmt, copy);
+    }
+
+    if (len > 0)
+        thiz->len += len;
+
+    va_end(copy);
+    va_end(args);
+}
+
+static void sink_write(struct sink *thiz, const void *data, size_t len)
+{
+    sink_reserve(thiz, len);
+    memcpy(&thiz->buf[thiz->len], data, len);
+    thiz->len += len;
+    thiz->buf[thiz->len] = 0;
+}
+
+static void sink_free(struct sink *thiz)
+{
+    free(thiz->buf);
+    thiz->buf = NULL, thiz->len = thiz->size = 0;
+}
 
 static struct _nt_suite *suites_list;
 static struct _nt_test* tests_list;
-static struct _nt_mock* mocks_list;
-
-static _Thread_local struct _nt_test *current_test;
+static struct _nt_test* benchmarks_list;
+
+/* Descriptors placed in the sections by the code compiled with _NT_USE_SECTIONS
+ * (see nedotest.h), the symbols are defined by the linker if the section exists. */
+#ifdef __ELF__
+#define SECTION_BOUNDS(type, kind)                                      \
+    extern type *const _NT_CONCAT(__start_, _NT_SECTION(kind))[] __attribute__((weak)); \
+    extern type *const _NT_CONCAT(__stop_, _NT_SECTION(kind))[] __attribute__((weak));
+#define SECTION_START(kind) _NT_CONCAT(__start_, _NT_SECTION(kind))
+#define SECTION_STOP(kind)  _NT_CONCAT(__stop_, _NT_SECTION(kind))
+#else
+#define SECTION_BOUNDS(type, kind)
+#define SECTION_START(kind) ((void*)0)
+#define SECTION_STOP(kind)  ((void*)0)
+#endif
 
-#ifdef __cplusplus
-#define _Thread_local thread_local
-#define _Alignas alignas
-#define max_align_t std::max_align_t
+#ifndef _NT_SECTION
+#define _NT_SECTION(kind) _NT_CONCAT(_nt_section_, kind)
 #endif
 
+SECTION_BOUNDS(const struct _nt_test, test_)
+SECTION_BOUNDS(const struct _nt_test, bench_)
+SECTION_BOUNDS(const struct _nt_suite, suite_)
+SECTION_BOUNDS(const struct _nt_site, site_)
+
+/* Get descriptors of all assertion sites, returns the count. */
+static size_t all_sites(const struct _nt_site *const **sites)
+{
+    size_t count = 0;
+    *sites = SECTION_START(site_);
+    for (const struct _nt_site *const *site = *sites; site != SECTION_STOP(site_); site++)
+        count++;
+
+    return count;
+}
+
+/* All the tests (or benchmarks): registered by constructors, then found in the section. */
+struct test_array {
+    const struct _nt_test **tests;
+    size_t count;
+};
+
+static struct test_array all_tests, all_benchmarks;
+
 // FIXME MSVC, also max_align_t, alignas, void *_alloca(size_t size), constructor
 
+/* Signal mask must be restored when the test is aborted from signal handler. */
+#ifdef __unix__
+typedef sigjmp_buf jump_buf;
+#define set_jump(env)   sigsetjmp(env, 1)
+#define long_jump(env)  siglongjmp(env, 1)
+#else
+typedef jmp_buf jump_buf;
+#define set_jump(env)   setjmp(env)
+#define long_jump(env)  longjmp(env, 1)
+#endif
+
+struct _nt_fail_info {
+    const char *fail_file;
+    unsigned fail_line;
+    char *fail_msg;
+};
+
+enum status { TEST_PASSED, TEST_FAILED, TEST_SKIPPED, TEST_CRASHED, TEST_TIMEOUT };
+
+static const char *const status_names[] = {"passed", "failed", "skipped", "crashed", "timeout"};
+
+/* State of running benchmark: number of iterations which must be performed
+ * by BENCHMARK_LOOP, the time when the loop started and finished (start is
+ * 0 if benchmark has no loop), and time of one iteration for each repetition. */
+struct bench {
+    unsigned long long iterations;
+    unsigned long long start, stop;
+    unsigned reps;
+    double *samples;    /* nanoseconds per iteration */
+};
+
+#ifdef __unix__
+/* Outcome of the thread attached to the test with ATTACH_TEST(), the record
+ * is passed to the test when the thread is detached. */
+struct thread_record {
+    struct thread_record *next;
+    enum status status;
+    struct _nt_fail_info first;     /* message is allocated on heap */
+    char *info, *skip_msg;
+    char *output;                   /* text printed by the thread */
+    size_t len;
+    char *events;                   /* events written by the reporter */
+    size_t events_len;
+};
+#endif
+
+/* State of currently running test, which is private for each thread. */
 struct context {
-    struct _nt_test *test;
-    jmp_buf exception;
+    const struct _nt_test *test;
+    jump_buf exception;
+    _nt_fixture_tag *fixture;
+    struct _nt_scope_msg *scope_msg;
+    struct _nt_fail_info first, last;
+    char *info;                 /* scope messages of the first failure */
+    char *skip_msg;             /* reason of skipping the test */
+    volatile enum status status;
+    volatile unsigned long long deadline;   /* time of the timeout, or 0 */
+    struct bench *bench;        /* NULL for the tests */
+#ifdef __unix__
+    struct context *owner;      /* context of the test, if the thread is attached */
+    struct mock_table *mocks;   /* mock states of the test */
+    _Atomic(struct thread_record*) records;     /* results of attached threads */
+    _Atomic unsigned thread_fails;              /* number of failed attached threads */
+#endif
+};
+
+enum phase { PHASE_SETUP, PHASE_TEST, PHASE_TEARDOWN, NUM_PHASES };
+
+/* Wall clock and thread CPU time (in nanoseconds) spent in each phase,
+ * CPU time is measured only if durations report is requested. */
+struct timing {
+    unsigned long long wall[NUM_PHASES];
+    unsigned long long cpu[NUM_PHASES];
+};
+
+/* Outcome of the test reported to the test runner, failure
+ * messages are allocated on heap and owned by the result. */
+struct result {
+    enum status status;
+    unsigned long long duration;    /* in nanoseconds */
+    struct timing timing;
+    struct _nt_fail_info first, last;
+    char *info, *skip_msg;
+    char *events;       /* events of the test written by the reporter */
+};
+
+static void result_free(struct result *result)
+{
+    free(result->first.fail_msg), free(result->last.fail_msg);
+    free(result->info), free(result->skip_msg), free(result->events);
+    result->first.fail_msg = result->last.fail_msg = NULL;
+    result->info = result->skip_msg = result->events = NULL;
+}
+
+/* Failed assertion, as it is given to the reporters. */
+struct failure {
+    const char *file;
+    unsigned line;
+    const char *name;           /* name of the assertion (CHECK, REQUIRE...) */
+    const char *op;             /* NULL for the assertion with single argument */
+    const char *left_expr, *left_value;
+    const char *right_expr, *right_value;
+    int nofail;                 /* the assertion doesn't fail the test */
+};
+
+/* Reporters write results of the tests in machine readable format to the
+ * report file (--out option) or to stdout. The report is streamed, each test
+ * is reported when it is finished, and the report file is closed properly
+ * (with `tail` string) when the program crashes. Events which happen while
+ * the test runs (optional) are collected in the buffer of the thread running
+ * the test and passed to the runner with the result. */
+struct reporter {
+    const char *name;
+    void (*begin)(struct sink *sink, const struct _nt_test *const *tests, unsigned ntests);
+    void (*test)(struct sink *sink, const struct _nt_test *test, const struct result *result);
+    void (*end)(struct sink *sink);
+    const char *tail;   /* closes the report, written by crash handler */
+    const char *crash;  /* closes the events of the test, if it crashed */
+
+    void (*start)(struct sink *sink, const struct _nt_test *test);
+    void (*failure)(struct sink *sink, const struct _nt_test *test, const struct failure *failure);
+    void (*message)(struct sink *sink, const struct _nt_test *test,
+                        const char *event, const char *file, unsigned line, const char *text);
+};
+
+static const struct reporter *reporter;
+static const char *report_file;
+static struct sink report_sink = {NULL, 0, 0, -1, NULL, 0};
+
+/* Events of the test running in current thread (the reporter which needs them
+ * provides `start`, the other two functions are optional), NULL if events
+ * aren't needed. */
+static _Thread_local struct sink tls_events = {NULL, 0, 0, -1, NULL, 0};
+static _Thread_local struct sink *events;
+
+static _Thread_local struct context *tls_context;
+
+/* Returns monotonic time in nanoseconds. */
+static unsigned long long time_ns(void)
+{
+    struct timespec ts;
+#ifdef __unix__
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Returns CPU time consumed by the calling thread in nanoseconds. The thread
+ * clock is preferred: usage reported by getrusage() is adjusted by the kernel
+ * and is too coarse for short tests. */
+static unsigned long long cpu_time_ns(void)
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#elif defined(RUSAGE_THREAD)
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+#else
+    return clock() * (1000000000ull / CLOCKS_PER_SEC);
+#endif
+}
+
+static double test_timeout(const struct _nt_test *test)
+{
+    return test->attr.timeout > 0 ? test->attr.timeout : timeout;
+}
+
+/* Account time elapsed since previous call to the given phase of the test. */
+static void timing_mark(struct timing *timing, enum phase phase,
+                            volatile unsigned long long *wall, volatile unsigned long long *cpu)
+{
+    unsigned long long now = time_ns();
+    timing->wall[phase] = now - *wall, *wall = now;
+
+    if (durations) {
+        now = cpu_time_ns();
+        timing->cpu[phase] = now - *cpu, *cpu = now;
+    }
+}
+
+/* Bump allocator for memory needed while the test is running (messages of
+ * INFO/CAPTURE, failure messages...): all the memory is released at once
+ * when the test is finished, chunks of memory are kept and reused by the
+ * next test run in the same thread. */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    max_align_t data[];
 };
 
+struct arena {
+    struct arena_chunk *first, *current;
+    size_t used;        /* bytes used in current chunk */
+    void *last;         /* last allocated block */
+};
+
+enum { ARENA_CHUNK_SIZE = 64 * 1024 };
+
+static _Thread_local struct arena tls_arena;
+
+static size_t arena_align(size_t size)
+{
+    return (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+}
+
+static void* arena_alloc(struct arena *thiz, size_t size)
+{
+    size = arena_align(size);
+
+    while (!thiz->current || thiz->used + size > thiz->current->size)
+    {
+        struct arena_chunk **next = thiz->current ? &thiz->current->next : &thiz->first;
+
+        /* chunk which is too small is skipped, new chunk is inserted before it */
+        if (!*next || (*next)->size < size)
+        {
+            size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            struct arena_chunk *chunk = malloc(offsetof(struct arena_chunk, data) + chunk_size);
+            if (!chunk) abort();
+
+            chunk->next = *next, chunk->size = chunk_size;
+            *next = chunk;
+        }
+
+        thiz->current = *next;
+        thiz->used = 0;
+    }
+
+    void *ptr = (char*)thiz->current->data + thiz->used;
+    thiz->used += size;
+    thiz->last = ptr;
+    return ptr;
+}
+
+/* Change size of the memory block, which is extended in place,
+ * if it was the last allocation in the arena. */
+static void* arena_realloc(struct arena *thiz, void *ptr, size_t old_size, size_t size)
+{
+    if (ptr && ptr == thiz->last) {
+        size_t offset = (size_t)((char*)ptr - (char*)thiz->current->data);
+        if (arena_align(size) <= thiz->current->size - offset) {
+            thiz->used = offset;
+            return arena_alloc(thiz, size);
+        }
+    }
+
+    void *mem = arena_alloc(thiz, size);
+    if (ptr)
+        memcpy(mem, ptr, old_size < size ? old_size : size);
+
+    return mem;
+}
+
+static char* arena_strdup(struct arena *thiz, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return (char*)memcpy(arena_alloc(thiz, len), str, len);
+}
+
+static void arena_reset(struct arena *thiz)
+{
+    thiz->current = NULL;
+    thiz->used = 0;
+    thiz->last = NULL;
+}
+
+static void arena_destroy(struct arena *thiz)
+{
+    while (thiz->first) {
+        struct arena_chunk *chunk = thiz->first;
+        thiz->first = chunk->next;
+        free(chunk);
+    }
+
+    arena_reset(thiz);
+}
+
 struct string_buf {
     const size_t capacity;
     size_t len;
@@ -193,37 +691,44 @@ void _nt_print_cstring(_nt_print_t out, const _nt_value_t* val)
 }
 
 
+/* Only ASCII letters are converted, locale doesn't matter. */
+#define ascii_lower(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
 /* Function matched string `str` against pattern `pattern`.
  * Characters compared in case-insensetive way (only ASCII),
  * asterisk (*) substitutes any amount of characters.
- * Function returns 1 if string matches to given pattern. */
+ * Function returns 1 if string matches to given pattern.
+ *
+ * If the string doesn't match after the last asterisk, only the last
+ * asterisk is extended by one character: earlier asterisks never need
+ * to be extended, so the time is O(len(str) * len(pattern)) at most. */
 static int match(const char *str, const char *pattern)
 {
-    while (1) 
+    const char *star = NULL, *resume = NULL;
+    while (*str)
     {
-        if (!*pattern)
-            return !*str;
-
-        if (*pattern == '*')
-        {
-            ++pattern;
-            while (1)
-            {
-                if (match(str, pattern))
-                    return 1;
-
-                if (!*str)
-                    return 0;
+        if (*pattern == '*') {
+            star = ++pattern;
+            resume = str;
+            continue;
+        }
 
-                ++str;
-            }
+        if (*pattern && ascii_lower(*pattern) == ascii_lower(*str)) {
+            ++pattern, ++str;
+            continue;
         }
-            
-        if (!*str || tolower(*pattern) != tolower(*str))
+
+        if (!star)
             return 0;
 
-        ++str, ++pattern;
+        pattern = star;
+        str = ++resume;
     }
+
+    while (*pattern == '*')
+        ++pattern;
+
+    return !*pattern;
 }
 
 
@@ -261,20 +766,88 @@ static int is_literal(const char *expr)
 }
 
 
+#define _NT_GET_FUNC(val_type, res_type) _NT_CONCAT(_NT_CONCAT(_NT_CONCAT(_nt_get_, val_type), _as_), res_type)
+#define _NT_GETTER(name) _NT_CONCAT(_nt_get_as_, name)
+#define _NT_DECL_CONV(name, type, ...) _NT_TYPENAME(name) (*_NT_GETTER(name))(const _nt_value_t *);
+
+typedef void _nt_print_fn(_nt_print_t, const _nt_value_t *);
+
+struct _nt_typeinfo {
+    _nt_print_fn* print;
+    _NT_TYPES(_NT_DECL_CONV, dummy)
+};
+
+
+/* Define getters. */
+
+#define NT_TYPES(APPLY, ...) \
+    APPLY(Char,         __VA_ARGS__) \
+    APPLY(signed_char,  __VA_ARGS__) \
+    APPLY(unsigned_char, __VA_ARGS__) \
+    APPLY(any_signed,   __VA_ARGS__) \
+    APPLY(any_unsigned, __VA_ARGS__) \
+    APPLY(any_float,    __VA_ARGS__) \
+    APPLY(any_pointer,  __VA_ARGS__) \
+    APPLY(cstring,      __VA_ARGS__)
+
+// TODO #define CHECK_TYPES(type, ...)
+
+#define NT_DEF_CONV1(type, ...) _NT_TYPES(NT_DEF_CONV2, type, __VA_ARGS__)
+
+#define NT_DEF_CONV2(res_type, unused, val_type, ...) \
+    static _NT_TYPENAME(res_type) _NT_GET_FUNC(val_type, res_type)(const _nt_value_t *val) {\
+        return _NT_CONV(res_type, val_type, val);                                           \
+    }
+
+NT_TYPES(NT_DEF_CONV1, dummy)
+
+/* Definition of all typeinfo structures (TODO apply MAP macro). */
+#define NT_DEF_CONV3(res_type, unused, val_type, ...) \
+    ._NT_GETTER(res_type) = _NT_GET_FUNC(val_type, res_type),
+
+#define NT_DEF_TYPEINFO(val_type, ...)                      \
+    const struct _nt_typeinfo _NT_TYPEINFO(val_type) = {    \
+        .print = _NT_CONCAT(_nt_print_, val_type),          \
+        _NT_TYPES(NT_DEF_CONV3, val_type)                   \
+    };
+
+NT_TYPES(NT_DEF_TYPEINFO, dummy)
+
+
+/* Messages of INFO and CAPTURE keep raw values of the arguments, which
+ * are formatted only when the test fails. Message of each INFO/CAPTURE
+ * (identified by source location) is kept in the memory, which is reused
+ * when the same INFO/CAPTURE is executed again. Messages are allocated
+ * in the arena, hash table is reused by all tests run in the thread. */
+
+struct scope_arg {
+    const char *name;       /* captured expression, or NULL for INFO */
+    _nt_typeinfo_t type;
+    _nt_value_t value;
+};
+
 struct scope_msg {
     const _nt_uniq_t ident;
     struct scope_msg *next_order, *prev_order;
     struct scope_msg *next_hash;
-    const char text[];
+    struct scope_msg *next_alloc;   /* list of all allocated messages */
+    size_t size;            /* allocated size */
+    const char *file;
+    unsigned line;
+    unsigned nargs;
+    struct scope_arg args[];    /* followed by copies of the strings */
 };
 
 struct _nt_scope_msg {
     const size_t hash_size;
     struct scope_msg *first_order;
     struct scope_msg *last_order;
+    struct scope_msg *allocated;
     struct scope_msg* hash[];
 };
 
+static _Thread_local struct _nt_scope_msg *tls_scope_msg;
+
 static unsigned ident_hash(_nt_uniq_t ident)
 {
     unsigned long long in = (unsigned long long)ident;
@@ -290,12 +863,15 @@ static struct _nt_scope_msg* scope_msg_create(size_t hash_size)
     struct _nt_scope_msg* ptr = malloc(offsetof(struct _nt_scope_msg, hash[hash_size]));
     if (!ptr) abort();
 
-    memcpy(ptr, &(struct _nt_scope_msg){hash_size, NULL, NULL}, sizeof(struct _nt_scope_msg));
+    memcpy(ptr, &(struct _nt_scope_msg){hash_size, NULL, NULL, NULL}, sizeof(struct _nt_scope_msg));
     memset(ptr->hash, 0, hash_size * sizeof(ptr->hash[0]));
     return ptr;
 }
 
-static void scope_msg_add(struct _nt_scope_msg *thiz, _nt_uniq_t ident, const char *str)
+/* Returns message of at least `size` bytes with given identifier, the message
+ * is moved (or added) to the end of the list, so messages are printed in
+ * the order in which INFO/CAPTURE were executed. */
+static struct scope_msg* scope_msg_add(struct _nt_scope_msg *thiz, _nt_uniq_t ident, size_t size)
 {
     unsigned idx = ident_hash(ident) % thiz->hash_size;
 
@@ -308,34 +884,37 @@ static void scope_msg_add(struct _nt_scope_msg *thiz, _nt_uniq_t ident, const ch
         pmsg = &(*pmsg)->next_hash;
     }
 
-    size_t len = strlen(str) + 1;
-    struct scope_msg* msg = malloc(offsetof(struct scope_msg, text[len]));
-    if (!msg) abort();
-
-    memcpy(msg, &(struct scope_msg){ident, NULL, NULL, NULL}, sizeof(struct scope_msg));
-    memcpy((void*)(intptr_t)msg->text, str, len);
-
-    if (*pmsg)
+    struct scope_msg *msg = *pmsg;
+    if (msg)
     {
-        msg->next_hash = (*pmsg)->next_hash;
-
-        if ((*pmsg)->prev_order)
-            (*pmsg)->prev_order->next_order = (*pmsg)->next_order;
+        if (msg->prev_order)
+            msg->prev_order->next_order = msg->next_order;
 
-        if ((*pmsg)->next_order)
-            (*pmsg)->next_order->prev_order = (*pmsg)->prev_order;
+        if (msg->next_order)
+            msg->next_order->prev_order = msg->prev_order;
 
-        if (thiz->last_order == *pmsg)
-            thiz->last_order = (*pmsg)->prev_order;
+        if (thiz->last_order == msg)
+            thiz->last_order = msg->prev_order;
 
-        if (thiz->first_order == *pmsg)
-            thiz->first_order = (*pmsg)->next_order;
+        if (thiz->first_order == msg)
+            thiz->first_order = msg->next_order;
 
-        free(*pmsg);
+        /* memory of the message is released only when the test is finished */
+        if (msg->size < size) {
+            *pmsg = msg->next_hash;
+            msg = NULL;
+        }
     }
 
-    *pmsg = msg;
+    if (!msg)
+    {
+        msg = (struct scope_msg*)arena_alloc(&tls_arena, size);
+        memcpy(msg, &(struct scope_msg){ident, NULL, NULL, *pmsg, thiz->allocated, size, NULL, 0, 0},
+                sizeof(struct scope_msg));
+        *pmsg = thiz->allocated = msg;
+    }
 
+    msg->next_order = NULL;
     msg->prev_order = thiz->last_order;
 
     if (thiz->last_order)
@@ -345,110 +924,123 @@ static void scope_msg_add(struct _nt_scope_msg *thiz, _nt_uniq_t ident, const ch
 
     if (!thiz->first_order)
         thiz->first_order = msg;
-}
-
-struct msg_cons {
-    int (*func)(struct msg_cons *, const char *);
-};
 
-static void scope_msg_get(struct _nt_scope_msg *thiz, struct msg_cons *cons)
-{
-    struct scope_msg *msg = thiz->first_order;
-    if (msg) {
-        while (msg) {
-            if (cons->func(cons, msg->text) < 0)
-                break;
-            msg = msg->next_order;
-        }
-    }
+    return msg;
 }
 
-static void scope_msg_reset(struct _nt_scope_msg *thiz)
+/* Store arguments of INFO (names == 0) or CAPTURE in the message, strings are
+ * copied, as these might be changed or destroyed until the test fails. */
+static void scope_msg_capture(struct _nt_scope_msg *thiz, _nt_uniq_t ident,
+            const char *file, unsigned line, int names, unsigned nargs, va_list args)
 {
-    for (unsigned n = 0; n < thiz->hash_size; n++)
-    {
-        struct scope_msg *msg = thiz->hash[n];
-        while (msg) {
-            void *mem = msg;
-            msg = msg->next_hash;
-            free(mem);
-        }
-        thiz->hash[n] = NULL;
-    }
-
-    thiz->first_order = thiz->last_order = NULL;
-}
-
-static void scope_msg_destroy(struct _nt_scope_msg *thiz)
-{
-    scope_msg_reset(thiz);
-    free(thiz);
-}
+    va_list count;
+    va_copy(count, args);
 
+    size_t size = offsetof(struct scope_msg, args[nargs]);
+    for (unsigned n = 0; n < nargs; n++)
+    {
+        if (names)
+            (void)va_arg(count, const char*);
 
+        const _nt_value_t *val = va_arg(count, _nt_value_t*);
+        _nt_typeinfo_t type = va_arg(count, _nt_typeinfo_t);
+        if (type == &_NT_TYPEINFO(cstring) && val->cstring)
+            size += strlen(val->cstring) + 1;
+    }
 
+    va_end(count);
 
-#define _NT_GET_FUNC(val_type, res_type) _NT_CONCAT(_NT_CONCAT(_NT_CONCAT(_nt_get_, val_type), _as_), res_type)
-#define _NT_GETTER(name) _NT_CONCAT(_nt_get_as_, name)
-#define _NT_DECL_CONV(name, type, ...) _NT_TYPENAME(name) (*_NT_GETTER(name))(const _nt_value_t *);
+    struct scope_msg *msg = scope_msg_add(thiz, ident, size);
+    msg->file = file, msg->line = line, msg->nargs = nargs;
 
-typedef void _nt_print_fn(_nt_print_t, const _nt_value_t *);
+    char *str = (char*)&msg->args[nargs];
+    for (unsigned n = 0; n < nargs; n++)
+    {
+        struct scope_arg *arg = &msg->args[n];
+        arg->name = names ? va_arg(args, const char*) : NULL;
+        arg->value = *va_arg(args, _nt_value_t*);
+        arg->type = va_arg(args, _nt_typeinfo_t);
+
+        if (arg->type == &_NT_TYPEINFO(cstring) && arg->value.cstring) {
+            size_t len = strlen(arg->value.cstring) + 1;
+            memcpy(str, arg->value.cstring, len);
+            arg->value.cstring = str;
+            str += len;
+        }
+    }
+}
 
-struct _nt_typeinfo {
-    _nt_print_fn* print;
-    _NT_TYPES(_NT_DECL_CONV, dummy)
-};
+/* Format the message same way, as if it was printed by INFO/CAPTURE. */
+static void scope_msg_print(_nt_print_t out, const struct scope_msg *msg)
+{
+    _NT_PRINTF(out, "%s:%u: ", msg->file, msg->line);
 
+    const char *dlm = "";
+    for (const struct scope_arg *arg = msg->args; arg != &msg->args[msg->nargs]; arg++)
+    {
+        if (!arg->name) {
+            if (arg->type == &_NT_TYPEINFO(cstring))
+                _NT_PRINTF(out, "%s", arg->value.cstring);
+            else
+                arg->type->print(out, &arg->value);
 
-/* Define getters. */
+            continue;
+        }
 
-#define NT_TYPES(APPLY, ...) \
-    APPLY(Char,         __VA_ARGS__) \
-    APPLY(signed_char,  __VA_ARGS__) \
-    APPLY(unsigned_char, __VA_ARGS__) \
-    APPLY(any_signed,   __VA_ARGS__) \
-    APPLY(any_unsigned, __VA_ARGS__) \
-    APPLY(any_float,    __VA_ARGS__) \
-    APPLY(any_pointer,  __VA_ARGS__) \
-    APPLY(cstring,      __VA_ARGS__)
+        if (!is_literal(arg->name))
+            _NT_PRINTF(out, "%s%s = ", dlm, arg->name);
+        else
+            _NT_PRINTF(out, "%s", dlm);
 
-// TODO #define CHECK_TYPES(type, ...)
+        arg->type->print(out, &arg->value);
+        dlm = ", ";
+    }
+}
 
-#define NT_DEF_CONV1(type, ...) _NT_TYPES(NT_DEF_CONV2, type, __VA_ARGS__)
+struct msg_cons {
+    int (*func)(struct msg_cons *, const char *);
+};
 
-#define NT_DEF_CONV2(res_type, unused, val_type, ...) \
-    static _NT_TYPENAME(res_type) _NT_GET_FUNC(val_type, res_type)(const _nt_value_t *val) {\
-        return (_NT_TYPENAME(res_type))_Generic((_NT_TYPENAME(res_type))0,                  \
-            _NT_TYPENAME(any_pointer): NT_CONV_PTR(res_type, val_type, val),                \
-            _NT_TYPENAME(cstring): NT_CONV_PTR(res_type, val_type, val),                    \
-            default: NT_CONV_INT(res_type, val_type, val));                                 \
+static void scope_msg_get(struct _nt_scope_msg *thiz, struct msg_cons *cons)
+{
+    struct scope_msg *msg = thiz->first_order;
+    while (msg) {
+        _nt_print_t text = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
+        scope_msg_print(text, msg);
+        if (cons->func(cons, text->buf.str) < 0)
+            break;
+        msg = msg->next_order;
     }
+}
 
-#define NT_CONV_PTR(res_type, val_type, val)        \
-    _Generic((_NT_TYPENAME(val_type))0,             \
-        _NT_TYPENAME(any_pointer): val->val_type,   \
-        _NT_TYPENAME(cstring): val->val_type,       \
-        default: 0)
-
-#define NT_CONV_INT(res_type, val_type, val)        \
-    _Generic((_NT_TYPENAME(val_type))0,             \
-        _NT_TYPENAME(any_pointer): 0,               \
-        _NT_TYPENAME(cstring): 0,                   \
-        default: val->val_type)
+/* Forget all messages, memory of the messages remains in the hash table
+ * and will be reused when the same INFO/CAPTURE is executed again. */
+static void scope_msg_reset(struct _nt_scope_msg *thiz)
+{
+    struct scope_msg *msg = thiz->first_order;
+    while (msg) {
+        struct scope_msg *next = msg->next_order;
+        msg->prev_order = msg->next_order = NULL;
+        msg = next;
+    }
 
-NT_TYPES(NT_DEF_CONV1, dummy)
+    thiz->first_order = thiz->last_order = NULL;
+}
 
-/* Definition of all typeinfo structures (TODO apply MAP macro). */
-#define NT_DEF_CONV3(res_type, unused, val_type, ...) \
-    ._NT_GETTER(res_type) = _NT_GET_FUNC(val_type, res_type),
+/* Remove all messages when the test is finished (before the arena is reset),
+ * only used buckets of the hash table are cleared. */
+static void scope_msg_clear(struct _nt_scope_msg *thiz)
+{
+    for (struct scope_msg *msg = thiz->allocated; msg; msg = msg->next_alloc)
+        thiz->hash[ident_hash(msg->ident) % thiz->hash_size] = NULL;
 
-#define NT_DEF_TYPEINFO(val_type, ...)                      \
-    const struct _nt_typeinfo _NT_TYPEINFO(val_type) = {    \
-        .print = _NT_CONCAT(_nt_print_, val_type),          \
-        _NT_TYPES(NT_DEF_CONV3, val_type)                   \
-    };
+    thiz->first_order = thiz->last_order = thiz->allocated = NULL;
+}
 
-NT_TYPES(NT_DEF_TYPEINFO, dummy)
+static void scope_msg_destroy(struct _nt_scope_msg *thiz)
+{
+    free(thiz);
+}
 
 /* Function which is called when particular assertion is failed. */
 static void assertion(
@@ -464,12 +1056,12 @@ static void assertion(
     else
         _NT_PRINTF(msg, "(%s)", left_expr);
 
-    assert(current_test != NULL);
+    assert(tls_context != NULL);
 
     unsigned offs = 0;
 
-    if (!(flags & _NT_NOASSERT) && !current_test->first.fail_line)
-        fprintf(out, "Test %s FAILED:\n", current_test->name), fflush(out);
+    if (!(flags & _NT_NOASSERT) && !tls_context->first.fail_line)
+        SINK_PRINTF(out, "Test %s FAILED:\n", tls_context->test->name);
 
     unsigned nl = 0;
     if (!is_literal(left_expr)) {
@@ -490,72 +1082,400 @@ static void assertion(
 
     if (nl) _NT_PRINTF(msg, ".\n");
 
-    fprintf(out, "%*s%s\n", offs, "", msg->buf.str);
-    fflush(out);
+    SINK_PRINTF(out, "%*s%s\n", offs, "", msg->buf.str);
+
+    if (events && reporter->failure) {
+        _nt_print_t left = (_nt_print_t)MAKE_STRING_BUF(LINE_MAX);
+        _nt_print_t right = (_nt_print_t)MAKE_STRING_BUF(LINE_MAX);
+        left_print(left, left_val);
+        if (!narg)
+            right_print(right, right_val);
+
+        struct failure failure = {
+            file, line, name, narg ? NULL : op,
+            left_expr, left->buf.str,
+            narg ? NULL : right_expr, narg ? NULL : right->buf.str,
+            !!(flags & _NT_NOASSERT)
+        };
+        reporter->failure(events, tls_context->test, &failure);
+    }
 
-    current_test->last.fail_file = file;
-    current_test->last.fail_line = line;
-    free(current_test->last.fail_msg);
-    current_test->last.fail_msg = strdup(msg->buf.str);
+    tls_context->last.fail_file = file;
+    tls_context->last.fail_line = line;
+    tls_context->last.fail_msg = arena_strdup(&tls_arena, msg->buf.str);
 
-    if (!current_test->first.fail_line && !(flags & _NT_NOASSERT)) {
-        current_test->first.fail_file = file;
-        current_test->first.fail_line = line;
-        free(current_test->first.fail_msg);
-        current_test->first.fail_msg = strdup(msg->buf.str);
+    if (!tls_context->first.fail_line && !(flags & _NT_NOASSERT)) {
+        tls_context->first.fail_file = file;
+        tls_context->first.fail_line = line;
+        tls_context->first.fail_msg = tls_context->last.fail_msg;
     }
 }
 
+/* Collects the text of all messages in the arena. */
 struct msg_collect {
     struct msg_cons cons;
     char *text;
+    size_t len;
 };
 
+#define MSG_COLLECT(str) \
+    {.cons.func = msg_collect, .text = arena_strdup(&tls_arena, str), .len = strlen(str)}
+
+/* Scope messages printed with the first failure are kept for the reporters,
+ * `len` is length of the failure message preceding the scope messages. */
+static void keep_scope_info(struct context *ctx, const struct msg_collect *col, size_t len)
+{
+    if (!ctx->info && col->len > len)
+        ctx->info = &col->text[len + 1];
+}
+
 int msg_collect(struct msg_cons *cons, const char *msg)
 {
     struct msg_collect *col = container_of(cons, struct msg_collect, cons);
     
-    size_t prev_len = col->text ? strlen(col->text) : 0;
     size_t next_len = strlen(msg);
-    size_t len = prev_len + next_len + 2;
-    char *text = realloc(col->text, len);
-    if (!text) return -1;
+    col->text = (char*)arena_realloc(&tls_arena, col->text, col->len + 1, col->len + next_len + 2);
 
-    snprintf(&text[prev_len], len, "\n%s", msg);
-    col->text = text;
+    snprintf(&col->text[col->len], next_len + 2, "\n%s", msg);
+    col->len += next_len + 1;
     return next_len;
 }
 
-void _nt_abort(void)
+/* Mock states of the tests run by a thread: the thread keeps the state of
+ * each mocked function in thread local storage (see _NT_MOCK_ANY_FUNCTION)
+ * and links it to the table on first call. Threads attached to the test use
+ * the table of the test thread, and the states of mocks, which weren't
+ * called by the test thread yet, are allocated on heap. */
+struct mock_table {
+#ifdef __unix__
+    pthread_mutex_t lock;
+#endif
+    struct _nt_mock_entry *entries;
+    struct mock_alloc *allocated;
+    unsigned long scope;        /* unique id of current test, or 0 */
+};
+
+struct mock_alloc {
+    struct mock_alloc *next;
+    struct _nt_mock_entry entry;
+    max_align_t state[];
+};
+
+enum { MOCK_NO_SCOPE = -1 };
+
+_Thread_local unsigned long _nt_mock_scope = (unsigned long)MOCK_NO_SCOPE;
+int _nt_mock_shared;
+
+static _Thread_local struct mock_table tls_mock_table = {
+#ifdef __unix__
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    NULL, NULL, 0
+};
+
+/* Table used by current thread: own table, or table of the attached test. */
+static _Thread_local struct mock_table *tls_mocks;
+
+#ifdef __unix__
+/* Table of the test started last, it's used by the threads which don't run
+ * the tests and aren't attached to the test (started by the tested code). */
+static _Atomic(struct mock_table*) running_mocks;
+#endif
+static _Thread_local int tls_mock_alloc;   /* allocating the mock state */
+
+static void mock_table_lock(struct mock_table *thiz)
+{
+#ifdef __unix__
+    pthread_mutex_lock(&thiz->lock);
+#else
+    (void)thiz;
+#endif
+}
+
+static void mock_table_unlock(struct mock_table *thiz)
+{
+#ifdef __unix__
+    pthread_mutex_unlock(&thiz->lock);
+#else
+    (void)thiz;
+#endif
+}
+
+static unsigned long mock_scope_next(void)
+{
+    static unsigned long last_scope;
+    return _NT_ATOMIC_INC(&last_scope) + 1;
+}
+
+/* Get the table of the tests run by the calling thread. */
+static struct mock_table *mock_table_own(void)
 {
-    assert(current_test != NULL);
+    struct mock_table *thiz = &tls_mock_table;
+    if (!thiz->scope)
+        thiz->scope = mock_scope_next();
+
+    return thiz;
+}
 
-    struct msg_collect col = {.cons.func = msg_collect, .text = strdup(current_test->first.fail_msg)};
-    scope_msg_get(current_test->scope_msg, &col.cons);
+/* Reset states of all mocks before the test: new scope invalidates
+ * pointers cached by the mocks, and each state is reset on first use. */
+static void mock_table_reset(struct mock_table *thiz)
+{
+    thiz->scope = mock_scope_next();
+    _nt_mock_scope = thiz->scope;
+}
 
-    fprintf(out, "%s: %u: failure with a message: %s\n",
-        current_test->first.fail_file, current_test->first.fail_line, col.text);
-    fflush(out);
+/* Forget all mocks of the calling thread (the thread might not run the tests anymore). */
+static void mock_table_free(void)
+{
+    struct mock_table *thiz = &tls_mock_table;
+    while (thiz->allocated) {
+        struct mock_alloc *next = thiz->allocated->next;
+        free(thiz->allocated);
+        thiz->allocated = next;
+    }
 
-    free(col.text);
+#ifdef __unix__
+    atomic_compare_exchange_strong(&running_mocks, &thiz, NULL);
+    thiz = &tls_mock_table;
+#endif
 
-    longjmp(*(jmp_buf*)current_test->jmpbuf, 1);
+    thiz->entries = NULL;
+    thiz->scope = 0;
+    tls_mocks = NULL;
+    _nt_mock_scope = (unsigned long)MOCK_NO_SCOPE;
 }
 
-void _nt_assert(void)
+/* Find the state of the mock `entry` for the current scope, `state` is the
+ * storage of the mock in the calling thread. */
+void *_nt_mock_lookup(struct _nt_mock_entry *own, void *state)
+{
+    /* allocator itself is mocked, its own state is used while
+     * the state of the other mock is allocated */
+    if (tls_mock_alloc) {
+        memset(state, 0, own->size);
+        return state;
+    }
+
+    struct mock_table *table = tls_mocks;
+#ifdef __unix__
+    /* thread started by the tested code uses mocks of the running test, the
+     * state isn't cached, as the test might finish at any moment */
+    if (!table && (table = atomic_load(&running_mocks)) != NULL)
+        _NT_ATOMIC_SET(&_nt_mock_shared, 1);
+#endif
+    if (!table)
+        table = tls_mocks = mock_table_own();
+
+    if (table == tls_mocks)
+        _nt_mock_scope = table->scope;
+
+    mock_table_lock(table);
+
+    struct _nt_mock_entry *entry = table->entries;
+    while (entry && entry->key != own->key)
+        entry = entry->next;
+
+    if (!entry) {
+        if (table == &tls_mock_table) {
+            entry = own;
+            entry->state = state;
+            memset(state, 0, own->size);
+        }
+        else {
+            tls_mock_alloc = 1;
+            struct mock_alloc *alloc = (struct mock_alloc*)calloc(1, sizeof(struct mock_alloc) + own->size);
+            tls_mock_alloc = 0;
+            if (!alloc) abort();
+
+            alloc->next = table->allocated;
+            table->allocated = alloc;
+            entry = &alloc->entry;
+            entry->key = own->key;
+            entry->size = own->size;
+            entry->state = alloc->state;
+        }
+
+        entry->generation = table->scope;
+        entry->next = table->entries;
+        table->entries = entry;
+    }
+    else if (entry->generation != table->scope) {
+        memset(entry->state, 0, entry->size);
+        entry->generation = table->scope;
+    }
+
+    mock_table_unlock(table);
+
+    own->mock = entry->state;
+    own->scope = table->scope;
+    return own->mock;
+}
+
+#ifdef __unix__
+static void release_test_memory(void);
+
+void *_nt_test_context(void)
+{
+    _NT_ATOMIC_SET(&_nt_mock_shared, 1);
+    return tls_context;
+}
+
+/* Attached thread gets its own context, which refers to the context of the
+ * test, and its own output, so assertions don't race with the test thread. */
+void _nt_attach_test(void *test_ctx)
+{
+    struct context *owner = (struct context*)test_ctx;
+    assert(owner && !tls_context);
+    while (owner->owner)
+        owner = owner->owner;
+
+    struct context *ctx = (struct context*)calloc(1, sizeof(struct context));
+    struct sink *sink = (struct sink*)calloc(1, sizeof(struct sink));
+    if (!ctx || !sink) abort();
+
+    if (!tls_scope_msg)
+        tls_scope_msg = scope_msg_create(1024);
+
+    ctx->test = owner->test;
+    ctx->fixture = owner->fixture;
+    ctx->scope_msg = tls_scope_msg;
+    ctx->status = TEST_PASSED;
+    ctx->owner = owner;
+    ctx->mocks = owner->mocks;
+    atomic_init(&ctx->records, NULL);
+    atomic_init(&ctx->thread_fails, 0);
+
+    sink->fd = -1;
+    out = sink;
+    events = reporter && reporter->start ? &tls_events : NULL;
+    if (events)
+        events->len = 0;
+
+    tls_context = ctx;
+    tls_mocks = ctx->mocks;
+    _nt_mock_scope = ctx->mocks->scope;
+    _NT_ATOMIC_SET(&_nt_mock_shared, 1);
+}
+
+/* Record the outcome of the attached thread in the context of the test,
+ * the records are pushed to the lock-free list, which is drained by the
+ * test thread when the test is finished. */
+void _nt_detach_test(void)
+{
+    struct context *ctx = tls_context;
+    assert(ctx && ctx->owner);
+
+    struct thread_record *rec = (struct thread_record*)malloc(sizeof(struct thread_record));
+    if (!rec) abort();
+
+    int failed = !!ctx->first.fail_line;
+    rec->status = failed ? TEST_FAILED : ctx->status;
+    rec->first = ctx->first;
+    rec->first.fail_msg = ctx->first.fail_msg ? strdup(ctx->first.fail_msg) : NULL;
+    rec->info = ctx->info ? strdup(ctx->info) : NULL;
+    rec->skip_msg = ctx->skip_msg ? strdup(ctx->skip_msg) : NULL;
+    rec->output = out->buf, rec->len = out->len;
+    rec->events = tls_events.buf, rec->events_len = events ? tls_events.len : 0;
+    tls_events.buf = NULL, tls_events.len = tls_events.size = 0;
+
+    struct context *owner = ctx->owner;
+    if (failed)
+        atomic_fetch_add(&owner->thread_fails, 1);
+
+    rec->next = atomic_load(&owner->records);
+    while (!atomic_compare_exchange_weak(&owner->records, &rec->next, rec))
+        ;
+
+    free(out), free(ctx);
+    out = NULL;
+    tls_context = NULL;
+    release_test_memory();
+}
+
+/* Append output of the attached threads to the output of the test (in order
+ * the threads were detached), and take the first failure if the test thread
+ * didn't fail itself. */
+static void collect_thread_records(struct context *ctx)
+{
+    struct thread_record *list = atomic_exchange(&ctx->records, NULL), *rev = NULL;
+    while (list) {
+        struct thread_record *next = list->next;
+        list->next = rev, rev = list, list = next;
+    }
+
+    while (rev) {
+        struct thread_record *rec = rev;
+        rev = rec->next;
+
+        if (rec->len)
+            sink_write(out, rec->output, rec->len);
+
+        if (rec->events_len && events)
+            sink_write(events, rec->events, rec->events_len);
+
+        if (rec->status == TEST_FAILED && !ctx->first.fail_line) {
+            ctx->first.fail_file = rec->first.fail_file;
+            ctx->first.fail_line = rec->first.fail_line;
+            ctx->first.fail_msg = arena_strdup(&tls_arena, rec->first.fail_msg ? rec->first.fail_msg : "");
+            if (!ctx->info && rec->info)
+                ctx->info = arena_strdup(&tls_arena, rec->info);
+            ctx->last = ctx->first;
+        }
+
+        if (rec->status == TEST_SKIPPED && ctx->status == TEST_PASSED) {
+            ctx->status = TEST_SKIPPED;
+            if (!ctx->skip_msg && rec->skip_msg)
+                ctx->skip_msg = arena_strdup(&tls_arena, rec->skip_msg);
+        }
+
+        free(rec->first.fail_msg), free(rec->info), free(rec->skip_msg);
+        free(rec->output), free(rec->events), free(rec);
+    }
+}
+#endif
+
+/* Abort the test: jump back to the test runner, or finish the attached
+ * thread, as it can't jump to the stack of another thread. */
+static void abort_test(struct context *ctx)
+{
+#ifdef __unix__
+    if (ctx->owner) {
+        _nt_detach_test();
+        pthread_exit(NULL);
+    }
+#endif
+    long_jump(ctx->exception);
+}
+
+void _nt_abort(void)
 {
-    assert(current_test != NULL);
+    assert(tls_context != NULL);
+
+    struct msg_collect col = MSG_COLLECT(tls_context->first.fail_msg);
+    size_t len = col.len;
+    scope_msg_get(tls_context->scope_msg, &col.cons);
+    keep_scope_info(tls_context, &col, len);
+
+    SINK_PRINTF(out, "%s: %u: failure with a message: %s\n",
+        tls_context->first.fail_file, tls_context->first.fail_line, col.text);
+
+    abort_test(tls_context);
+}
 
-    struct msg_collect col = {.cons.func = msg_collect, .text = strdup(current_test->last.fail_msg)};
-    scope_msg_get(current_test->scope_msg, &col.cons);
+void _nt_assert(void)
+{
+    assert(tls_context != NULL);
 
-    scope_msg_reset(current_test->scope_msg);
+    struct msg_collect col = MSG_COLLECT(tls_context->last.fail_msg);
+    size_t len = col.len;
+    scope_msg_get(tls_context->scope_msg, &col.cons);
+    keep_scope_info(tls_context, &col, len);
 
-    fprintf(out, "%s: %u: failure with a message: %s\n",
-        current_test->first.fail_file, current_test->first.fail_line, col.text);
-    fflush(out);
+    scope_msg_reset(tls_context->scope_msg);
 
-    free(col.text);
+    SINK_PRINTF(out, "%s: %u: failure with a message: %s\n",
+        tls_context->first.fail_file, tls_context->first.fail_line, col.text);
 }
 
 
@@ -582,10 +1502,10 @@ void _nt_assert(void)
         (void)dummy;                                                            \
         return !!IMPL_FUNC(op_name)(                                            \
             left_type->_NT_GETTER(type)(left_val),                              \
-            right_type->_NT_GETTER(type)(right_val)) ^ (flags & _NT_NEG_OP) ? 1 \
-         : (assertion(name, file, line, flags, op, narg,                        \
-                left_expr, left_val, left_type->print,                          \
-                right_expr, right_val, right_type->print), 0);                  \
+            right_type->_NT_GETTER(type)(right_val)) ^ (site->flags & _NT_NEG_OP) ? 1 \
+         : (assertion(site->name, site->file, site->line, site->flags, site->op,   \
+                site->narg, site->left_expr, left_val, left_type->print,        \
+                site->right_expr, right_val, right_type->print), 0);            \
     }
 
 /* Instantiate template listed above for all types and all binary operations
@@ -602,45 +1522,62 @@ COMP_TEMPLATE(_OP_NOT_CONTAINS_, cstring)
 COMP_TEMPLATE(_OP_MATCHES_, cstring)
 COMP_TEMPLATE(_OP_NOT_MATCHES_, cstring)
 
-void _nt_register_mock(struct _nt_mock *mock)
+void _nt_trap(void)
 {
-    mock->next = mocks_list;
-    mocks_list = mock;
+    volatile int x = 0;
+    (void)x;
 }
 
-static void reset_all_mocks(void)
+/* Hash table of the suites (open addressing), suites are looked up by name
+ * when each test, setup or teardown function is registered. */
+static struct suites_hash {
+    struct _nt_suite **slots;
+    size_t size, count;
+} suites_hash;
+
+static unsigned string_hash(const char *str)
 {
-    struct _nt_mock *mock = mocks_list;
-    while (mock) {
-        mock->func();
-        mock = mock->next;
-    }
+    unsigned hash = 2166136261;
+    while (*str)
+        hash = (hash ^ (unsigned char)*str++) * 16777619;
+
+    return hash;
 }
 
-void _nt_trap(void)
+static struct _nt_suite** suite_slot(struct suites_hash *thiz, const char *name)
 {
-    volatile int x = 0;
-    (void)x;
+    size_t n = string_hash(name) & (thiz->size - 1);
+    while (thiz->slots[n] && strcmp(thiz->slots[n]->name, name))
+        n = (n + 1) & (thiz->size - 1);
+
+    return &thiz->slots[n];
 }
 
-static struct _nt_suite* find_suite(const char *name)
+static void suites_hash_grow(struct suites_hash *thiz)
 {
-    struct _nt_suite *suite = suites_list;
-    while (suite) 
-    {
-        if (!strcmp(suite->name, name))
-            return suite;
+    struct suites_hash grown = {NULL, thiz->size ? 2 * thiz->size : 64, thiz->count};
+    grown.slots = calloc(grown.size, sizeof(*grown.slots));
+    if (!grown.slots) abort();
 
-        suite = suite->next;
-    }
-    return NULL;
+    for (size_t n = 0; n < thiz->size; n++)
+        if (thiz->slots[n])
+            *suite_slot(&grown, thiz->slots[n]->name) = thiz->slots[n];
+
+    free(thiz->slots);
+    *thiz = grown;
 }
 
 const struct _nt_suite* _nt_setup_suite(struct _nt_suite *suite)
 {
-    struct _nt_suite *other = find_suite(suite->name);
+    if (2 * (suites_hash.count + 1) > suites_hash.size)
+        suites_hash_grow(&suites_hash);
+
+    struct _nt_suite **slot = suite_slot(&suites_hash, suite->name);
+    struct _nt_suite *other = *slot;
     if (!other) 
     {
+        *slot = suite;
+        suites_hash.count++;
         suite->next = suites_list;
         suites_list = suite;
     }
@@ -660,313 +1597,3181 @@ const struct _nt_suite* _nt_setup_suite(struct _nt_suite *suite)
     return suite;
 }
 
-void _nt_register_test(struct _nt_test *test)
+/* Suite of the test compiled with _NT_USE_SECTIONS has only the name: setup,
+ * teardown functions and size of the fixture are found by the name. If `add`
+ * is set, the suite which has no fixture is added to the list of suites. */
+static const struct _nt_suite* test_suite(const struct _nt_test *test, int add)
 {
-    /* sort tests first by file name, second by line number */
-    struct _nt_test **next = &tests_list;
-    while (*next)
-    {
-        int nf = strcmp(test->file, (*next)->file);
-        if (nf < 0)
-            break;
+    if (suites_hash.size) {
+        struct _nt_suite **slot = suite_slot(&suites_hash, test->suite->name);
+        if (*slot)
+            return *slot;
+    }
 
-        if (!nf && test->file < (*next)->file)
-            break;
+    if (!add)
+        return test->suite;
 
-        next = &(*next)->next;
-    }
-   
-    test->next = *next;
-    *next = test;
+    struct _nt_suite *suite = malloc(sizeof(*suite));
+    if (!suite) abort();
+
+    memcpy(suite, test->suite, sizeof(*suite));
+    return _nt_setup_suite(suite);
 }
 
-static int run_test(struct _nt_test *test)
+/* Suites found in the section are copied, as these are merged with suites
+ * registered by constructors. */
+static void register_section_suites(void)
 {
-    fprintf(out, "running %s\n", test->name);
-    fflush(out);
+    for (const struct _nt_suite *const *desc = SECTION_START(suite_); desc != SECTION_STOP(suite_); desc++)
+    {
+        struct _nt_suite *suite = malloc(sizeof(*suite));
+        if (!suite) abort();
 
-    #ifndef __cplusplus
-    _Alignas(max_align_t) char fixture [test->suite->fixture_size];
-    #else
-    char *fixture = (char*)alloca(test->suite->fixture_size);
-    #endif
+        memcpy(suite, *desc, sizeof(*suite));
+        if (_nt_setup_suite(suite) != suite)
+            free(suite);
+    }
+}
 
-    memset(fixture, 0, test->suite->fixture_size);
-    test->fixture = (_nt_fixture_tag*)fixture;
-    test->scope_msg = scope_msg_create(1024);
-    test->first.fail_line = 0, test->first.fail_file = test->first.fail_msg = NULL;
-    test->last.fail_line = 0, test->last.fail_file = test->last.fail_msg = NULL;
+/* Tests are prepended to the list when registered, and sorted once before
+ * running them (see sort_tests), so the registration takes O(1) time. */
+void _nt_register_test(struct _nt_test *test)
+{
+    test->next = tests_list;
+    tests_list = test;
+}
 
-    current_test = test;
-    reset_all_mocks();
+void _nt_register_benchmark(struct _nt_test *test)
+{
+    test->next = benchmarks_list;
+    benchmarks_list = test;
+}
 
-    if (test->suite->setup)
-        test->suite->setup((_nt_fixture_tag*)fixture);
+static int test_cmp(const void *left, const void *right)
+{
+    const struct _nt_test *l = *(const struct _nt_test *const*)left;
+    const struct _nt_test *r = *(const struct _nt_test *const*)right;
 
-    struct context ctx;
-    ctx.test = test;
-    test->jmpbuf = &ctx.exception;
-    if (!setjmp(ctx.exception))
-    {
-        // tls_context = &ctx;
-        test->func((_nt_fixture_tag*) fixture);
-    }
+    int nf = l->file == r->file ? 0 : strcmp(l->file, r->file);
+    if (nf)
+        return nf;
 
-    int result = !!current_test->first.fail_line;
+    if (l->line != r->line)
+        return l->line < r->line ? -1 : 1;
 
-    // tls_context = NULL;
+    /* several tests might be defined by one macro */
+    return strcmp(l->name, r->name);
+}
 
-    if (test->suite->teardown)
-        test->suite->teardown((_nt_fixture_tag*)fixture);
+/* Make array of the tests registered by constructors and the tests found in
+ * the section, sorted first by file name, second by line number, so the order
+ * doesn't depend on the way the tests are registered. */
+static void collect_tests(struct test_array *thiz, struct _nt_test *list,
+        const struct _nt_test *const *start, const struct _nt_test *const *stop)
+{
+    size_t count = 0;
+    for (struct _nt_test *test = list; test; test = test->next)
+        ++count;
 
-    free(test->first.fail_msg), free(test->last.fail_msg);
-    test->first.fail_msg = test->last.fail_msg = NULL;
+    thiz->count = count + (start ? stop - start : 0);
+    thiz->tests = malloc((thiz->count + 1) * sizeof(*thiz->tests));
+    if (!thiz->tests) abort();
 
-    scope_msg_destroy(test->scope_msg);
-    test->scope_msg = NULL;
+    count = 0;
+    for (struct _nt_test *test = list; test; test = test->next)
+        thiz->tests[count++] = test;
 
-    current_test = NULL;
+    if (start)
+        memcpy(&thiz->tests[count], start, (stop - start) * sizeof(*start));
 
-    return result;
+    qsort(thiz->tests, thiz->count, sizeof(*thiz->tests), test_cmp);
 }
 
-int _nt_is_fail(void)
+#ifdef __unix__
+/* Watchdog thread aborts the tests running longer than the timeout: each
+ * thread running the tests has a slot with deadline of current test, and
+ * when the deadline passes, the watchdog sends SIGALRM to that thread.
+ * Signal handler aborts the test via longjmp, same way as REQUIRE does. */
+
+struct watch_slot {
+    pthread_t thread;
+    _Atomic unsigned long long deadline;
+};
+
+static struct watchdog {
+    pthread_t thread;
+    struct watch_slot *slots;
+    _Atomic unsigned nslots;
+    unsigned capacity;
+    _Atomic int stop;
+    struct sigaction old_action;
+} watchdog;
+
+static _Thread_local struct watch_slot *tls_slot;
+
+enum { WATCHDOG_PERIOD = 10 };     /* milliseconds */
+
+static void timeout_handler(int sig)
 {
-    int result = !!current_test->first.fail_line;
-    if (!result) _nt_scope_reset();
-    return result;
+    (void)sig;
+
+    struct context *ctx = tls_context;
+    if (ctx && ctx->deadline && time_ns() >= ctx->deadline) {
+        ctx->status = TEST_TIMEOUT;
+        ctx->deadline = 0;
+        long_jump(ctx->exception);
+    }
 }
 
-static void _nt_message(_nt_print_t msg, unsigned nargs, va_list args)
+static void* watchdog_thread(void *arg)
 {
-    for (unsigned n = 0; n < nargs; n++)
+    (void)arg;
+
+    while (!atomic_load(&watchdog.stop))
     {
-        const _nt_value_t *val = va_arg(args, _nt_value_t*);
-        _nt_typeinfo_t type = va_arg(args, _nt_typeinfo_t);
+        nanosleep(&(struct timespec){0, WATCHDOG_PERIOD * 1000000L}, NULL);
 
-        if (type->print == _nt_print_cstring)
-            _NT_PRINTF(msg, "%s", val->cstring);
-        else
-            type->print(msg, val);
+        unsigned long long now = time_ns();
+        for (unsigned n = 0; n < atomic_load(&watchdog.nslots); n++)
+        {
+            struct watch_slot *slot = &watchdog.slots[n];
+            unsigned long long deadline = atomic_load_explicit(&slot->deadline, memory_order_relaxed);
+            if (deadline && now >= deadline
+                && atomic_compare_exchange_strong(&slot->deadline, &deadline, 0))
+            {
+                pthread_kill(slot->thread, SIGALRM);
+            }
+        }
     }
+
+    return NULL;
 }
 
-void _nt_fail(const char *file, unsigned line, unsigned nargs, ...)
+/* Start the watchdog for given maximal number of threads running the tests. */
+static int watchdog_start(unsigned nthreads)
 {
-    va_list args;
+    watchdog.slots = calloc(nthreads, sizeof(*watchdog.slots));
+    if (!watchdog.slots) abort();
+
+    watchdog.capacity = nthreads;
+    atomic_store(&watchdog.nslots, 0);
+    atomic_store(&watchdog.stop, 0);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = timeout_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, &watchdog.old_action);
+
+    if (pthread_create(&watchdog.thread, NULL, watchdog_thread, NULL)) {
+        sigaction(SIGALRM, &watchdog.old_action, NULL);
+        free(watchdog.slots);
+        watchdog.slots = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void watchdog_stop(void)
+{
+    if (!watchdog.slots)
+        return;
+
+    atomic_store(&watchdog.stop, 1);
+    pthread_join(watchdog.thread, NULL);
+    sigaction(SIGALRM, &watchdog.old_action, NULL);
+    free(watchdog.slots);
+    watchdog.slots = NULL;
+}
+
+/* Register calling thread within the watchdog. */
+static void watchdog_attach(void)
+{
+    if (!watchdog.slots)
+        return;
+
+    unsigned n = atomic_fetch_add(&watchdog.nslots, 1);
+    assert(n < watchdog.capacity);
+
+    tls_slot = &watchdog.slots[n];
+    tls_slot->thread = pthread_self();
+}
+
+static void watchdog_detach(void)
+{
+    if (tls_slot)
+        atomic_store(&tls_slot->deadline, 0);
+
+    tls_slot = NULL;
+}
+
+/* Set deadline for currently running test. */
+static void watchdog_arm(struct context *ctx, double seconds)
+{
+    if (!tls_slot)
+        return;
+
+    ctx->deadline = seconds > 0 ? time_ns() + (unsigned long long)(seconds * 1e9) : 0;
+    atomic_store(&tls_slot->deadline, ctx->deadline);
+}
+
+static void watchdog_disarm(struct context *ctx)
+{
+    if (!tls_slot)
+        return;
+
+    atomic_store(&tls_slot->deadline, 0);
+    ctx->deadline = 0;
+}
+#else
+static void watchdog_attach(void) {}
+static void watchdog_detach(void) {}
+static void watchdog_arm(struct context *ctx, double seconds) { (void)ctx, (void)seconds; }
+static void watchdog_disarm(struct context *ctx) { (void)ctx; }
+#endif
+
+#ifdef __unix__
+/* Fatal signals (SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT) are handled on the
+ * alternate stack (so stack overflow is handled too). The handler records the
+ * signal, fault address and return addresses of the stack frames: with
+ * --catch-crashes option it aborts the test via longjmp, as REQUIRE does, and
+ * the crash is reported as the failure of the test, otherwise the program
+ * terminates. Worker process sends the crash to the runner before it dies,
+ * the runner converts addresses to symbols (worker has the same memory layout). */
+
+enum { CRASH_FRAMES = 32, ALT_STACK_SIZE = 64 * 1024 };
+
+struct crash {
+    int signal;         /* 0 if no crash happened */
+    void *addr;         /* fault address (see is_fault_signal) */
+    unsigned nframes;
+    void *frames[CRASH_FRAMES];
+};
+
+static _Thread_local struct crash tls_crash;
+static _Thread_local void *tls_alt_stack;
+
+/* Signal handler must not allocate memory, so alternate stack is allocated
+ * for each thread running the tests. */
+static void alt_stack_init(void)
+{
+    if (tls_alt_stack)
+        return;
+
+    tls_alt_stack = malloc(ALT_STACK_SIZE);
+    if (!tls_alt_stack) abort();
+
+    stack_t ss = {.ss_sp = tls_alt_stack, .ss_flags = 0, .ss_size = ALT_STACK_SIZE};
+    sigaltstack(&ss, NULL);
+}
+
+static void alt_stack_free(void)
+{
+    if (!tls_alt_stack)
+        return;
+
+    stack_t ss = {.ss_sp = NULL, .ss_flags = SS_DISABLE, .ss_size = 0};
+    sigaltstack(&ss, NULL);
+    free(tls_alt_stack);
+    tls_alt_stack = NULL;
+}
+
+/* Signals which have the fault address. */
+static int is_fault_signal(int sig)
+{
+    return sig == SIGSEGV || sig == SIGBUS || sig == SIGFPE || sig == SIGILL;
+}
+
+/* Print description of the crash and the stack trace. */
+static void print_crash(struct sink *sink, const struct crash *crash)
+{
+    SINK_PRINTF(sink, "signal %d (%s)", crash->signal, strsignal(crash->signal));
+    if (is_fault_signal(crash->signal))
+        SINK_PRINTF(sink, " at address %p", crash->addr);
+
+#ifdef HAVE_BACKTRACE
+    char **symbols = crash->nframes ? backtrace_symbols(crash->frames, crash->nframes) : NULL;
+    for (unsigned n = 0; n < crash->nframes; n++) {
+        if (symbols)
+            SINK_PRINTF(sink, "\n    #%u %s", n, symbols[n]);
+        else
+            SINK_PRINTF(sink, "\n    #%u %p", n, crash->frames[n]);
+    }
+
+    free(symbols);
+#endif
+}
+
+/* Record the crash of the test caught by signal handler as the failure. */
+static void crash_failure(struct context *ctx, struct crash *crash)
+{
+    struct sink text = {NULL, 0, 0, -1, NULL, 0};
+    print_crash(&text, crash);
+    crash->signal = 0;
+
+    if (events && reporter->message)
+        reporter->message(events, ctx->test, "failure", ctx->test->file, ctx->test->line, text.buf);
+
+    SINK_PRINTF(out, "Test %s CRASHED: %s\n", ctx->test->name, text.buf);
+
+    ctx->last.fail_file = ctx->test->file;
+    ctx->last.fail_line = ctx->test->line;
+    ctx->last.fail_msg = arena_strdup(&tls_arena, text.buf);
+    if (!ctx->first.fail_line)
+        ctx->first = ctx->last;
+
+    sink_free(&text);
+}
+#endif
+
+static void bench_run(struct context *ctx, struct bench *bench);
+
+/* Run the test, or the benchmark if `bench` isn't NULL. */
+static void run_test(const struct _nt_test *test, struct bench *bench, struct result *result)
+{
+    result->timing = (struct timing){{0}, {0}};
+
+    SINK_PRINTF(out, "running %s\n", test->name);
+
+    /* the test might print to stdout itself, and its output must follow this line */
+    sink_hold(out);
+
+    events = reporter && reporter->start ? &tls_events : NULL;
+    if (events) {
+        events->len = 0;
+        reporter->start(events, test);
+    }
+
+    const struct _nt_suite *suite = test_suite(test, 0);
+
+    #ifndef __cplusplus
+    _Alignas(max_align_t) char fixture [suite->fixture_size];
+    #else
+    char *fixture = (char*)alloca(suite->fixture_size);
+    #endif
+
+    memset(fixture, 0, suite->fixture_size);
+
+    struct context ctx;
+    ctx.test = test;
+    ctx.fixture = (_nt_fixture_tag*)fixture;
+    if (!tls_scope_msg)
+        tls_scope_msg = scope_msg_create(1024);
+
+    ctx.scope_msg = tls_scope_msg;
+    ctx.first.fail_line = 0, ctx.first.fail_file = ctx.first.fail_msg = NULL;
+    ctx.last.fail_line = 0, ctx.last.fail_file = ctx.last.fail_msg = NULL;
+    ctx.info = ctx.skip_msg = NULL;
+    ctx.status = TEST_PASSED;
+    ctx.deadline = 0;
+    ctx.bench = bench;
+#ifdef __unix__
+    ctx.owner = NULL;
+    atomic_init(&ctx.records, NULL);
+    atomic_init(&ctx.thread_fails, 0);
+#endif
+
+    tls_context = &ctx;
+    tls_mocks = &tls_mock_table;
+    mock_table_reset(tls_mocks);
+#ifdef __unix__
+    ctx.mocks = tls_mocks;
+    atomic_store(&running_mocks, tls_mocks);
+#endif
+
+    /* setup function and the test might be aborted by assertion or timeout,
+     * the phases are timed from here, so the time of the runner isn't counted */
+    volatile enum phase phase = PHASE_SETUP;
+    watchdog_arm(&ctx, test_timeout(test));
+    unsigned long long start = time_ns();
+    volatile unsigned long long wall = start;
+    volatile unsigned long long cpu = durations ? cpu_time_ns() : 0;
+    if (!set_jump(ctx.exception))
+    {
+        if (suite->setup)
+            suite->setup((_nt_fixture_tag*)fixture);
+
+        timing_mark(&result->timing, PHASE_SETUP, &wall, &cpu);
+        phase = PHASE_TEST;
+
+        if (bench)
+            bench_run(&ctx, bench);
+        else
+            test->func((_nt_fixture_tag*) fixture);
+    }
+
+    timing_mark(&result->timing, phase, &wall, &cpu);
+
+#ifdef __unix__
+    if (tls_crash.signal)
+        crash_failure(&ctx, &tls_crash);
+#endif
+
+    /* teardown gets its own time slice, if the test is timed out */
+    int timed_out = ctx.status == TEST_TIMEOUT;
+    if (timed_out) {
+        SINK_PRINTF(out, "Test %s TIMED OUT after %g seconds\n", test->name, test_timeout(test));
+        sink_flush(out);
+        watchdog_arm(&ctx, test_timeout(test));
+    }
+
+    if (!set_jump(ctx.exception))
+    {
+        if (suite->teardown)
+            suite->teardown((_nt_fixture_tag*)fixture);
+    }
+
+    watchdog_disarm(&ctx);
+    timing_mark(&result->timing, PHASE_TEARDOWN, &wall, &cpu);
+
+#ifdef __unix__
+    if (tls_crash.signal)
+        crash_failure(&ctx, &tls_crash);
+#endif
+
+    if (!timed_out && ctx.status == TEST_TIMEOUT) {
+        SINK_PRINTF(out, "Test %s TIMED OUT in teardown after %g seconds\n", test->name, test_timeout(test));
+    }
+
+#ifdef __unix__
+    collect_thread_records(&ctx);
+
+    struct mock_table *mocks = &tls_mock_table;
+    atomic_compare_exchange_strong(&running_mocks, &mocks, NULL);
+#endif
+
+    result->status = ctx.status == TEST_TIMEOUT || ctx.status == TEST_CRASHED ? ctx.status
+                        : ctx.first.fail_line ? TEST_FAILED : ctx.status;
+    result->duration = wall - start;
+
+    /* failure messages are owned by the result, all other memory is released */
+    result->first = ctx.first, result->last = ctx.last;
+    result->first.fail_msg = ctx.first.fail_msg ? strdup(ctx.first.fail_msg) : NULL;
+    result->last.fail_msg = ctx.last.fail_msg ? strdup(ctx.last.fail_msg) : NULL;
+    result->info = ctx.info ? strdup(ctx.info) : NULL;
+    result->skip_msg = ctx.skip_msg ? strdup(ctx.skip_msg) : NULL;
+    result->events = events && events->len ? strdup(events->buf) : NULL;
+    events = NULL;
+
+    scope_msg_clear(ctx.scope_msg);
+    arena_reset(&tls_arena);
+
+    tls_context = NULL;
+    sink_flush(out);
+}
+
+/* Release memory which is kept for the tests run by the calling thread. */
+static void release_test_memory(void)
+{
+    if (tls_scope_msg)
+        scope_msg_destroy(tls_scope_msg);
+
+    tls_scope_msg = NULL;
+    arena_destroy(&tls_arena);
+    sink_free(&tls_events);
+    events = NULL;
+    mock_table_free();
+}
+
+int _nt_is_fail(void)
+{
+    int result = !!tls_context->first.fail_line;
+#ifdef __unix__
+    result |= !!atomic_load(&tls_context->thread_fails);
+#endif
+    if (!result) _nt_scope_reset();
+    return result;
+}
+
+static void _nt_message(_nt_print_t msg, unsigned nargs, va_list args)
+{
+    for (unsigned n = 0; n < nargs; n++)
+    {
+        const _nt_value_t *val = va_arg(args, _nt_value_t*);
+        _nt_typeinfo_t type = va_arg(args, _nt_typeinfo_t);
+
+        if (type->print == _nt_print_cstring)
+            _NT_PRINTF(msg, "%s", val->cstring);
+        else
+            type->print(msg, val);
+    }
+}
+
+void _nt_fail(const char *file, unsigned line, unsigned nargs, ...)
+{
+    va_list args;
+    va_start(args, nargs);
+    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
+    _NT_PRINTF(msg, "%s:%u: ", file, line);
+    size_t prefix = msg->buf.len;
+    _nt_message(msg, nargs, args);
+
+    if (events && reporter->message)
+        reporter->message(events, tls_context->test, "failure", file, line, msg->buf.str + prefix);
+
+    struct msg_collect col = MSG_COLLECT(msg->buf.str);
+    size_t len = col.len;
+    scope_msg_get(tls_context->scope_msg, &col.cons);
+
+    if (!tls_context->first.fail_line) {
+        SINK_PRINTF(out, "Test %s FAILED:\n", tls_context->test->name);
+        tls_context->first.fail_file = file;
+        tls_context->first.fail_line = line;
+        tls_context->first.fail_msg = col.text;
+        keep_scope_info(tls_context, &col, len);
+    }
+
+    SINK_PRINTF(out, "%s: %u: failure with a message: %s\n", file, line, col.text);
+
+    abort_test(tls_context);
+}
+
+void _nt_fail_check(const char *file, unsigned line, unsigned nargs, ...)
+{
+    va_list args;
+    va_start(args, nargs);
+
+    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
+    _NT_PRINTF(msg, "%s:%u: ", file, line);
+    size_t prefix = msg->buf.len;
+    _nt_message(msg, nargs, args);
+
+    if (events && reporter->message)
+        reporter->message(events, tls_context->test, "failure", file, line, msg->buf.str + prefix);
+
+    struct msg_collect col = MSG_COLLECT(msg->buf.str);
+    size_t len = col.len;
+    scope_msg_get(tls_context->scope_msg, &col.cons);
+
+    scope_msg_reset(tls_context->scope_msg);
+
+    if (!tls_context->first.fail_line) {
+        SINK_PRINTF(out, "Test %s FAILED:\n", tls_context->test->name);
+        tls_context->first.fail_file = file;
+        tls_context->first.fail_line = line;
+        tls_context->first.fail_msg = col.text;
+        keep_scope_info(tls_context, &col, len);
+    }
+
+    SINK_PRINTF(out, "%s: %u: failure with a message: %s\n", file, line, col.text);
+
+    va_end(args);
+}
+
+void _nt_skip(const char *file, unsigned line, unsigned nargs, ...)
+{
+    va_list args;
+    va_start(args, nargs);
+    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
+    _NT_PRINTF(msg, "%s:%u: ", file, line);
+    size_t prefix = msg->buf.len;
+    _nt_message(msg, nargs, args);
+    SINK_PRINTF(out, "Test %s is skipped at %s:%u: %s\n", tls_context->test->name, file, line, msg->buf.str);
+
+    if (events && reporter->message)
+        reporter->message(events, tls_context->test, "skip", file, line, msg->buf.str + prefix);
+
+    tls_context->skip_msg = arena_strdup(&tls_arena, msg->buf.str);
+    tls_context->status = TEST_SKIPPED;
+    abort_test(tls_context);
+}
+
+void _nt_success(const char *file, unsigned line, unsigned nargs, ...)
+{
+    va_list args;
+    va_start(args, nargs);
+    if (nargs) {
+        _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
+        _NT_PRINTF(msg, "%s:%u: ", file, line);
+        _nt_message(msg, nargs, args);
+        SINK_PRINTF(out, "%s\n", msg->buf.str);
+    }
+    assert(tls_context);
+    abort_test(tls_context);
+}
+
+void _nt_warn(const char *file, unsigned line, unsigned nargs, ...)
+{
+    va_list args;
     va_start(args, nargs);
     _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
     _NT_PRINTF(msg, "%s:%u: ", file, line);
+    size_t prefix = msg->buf.len;
     _nt_message(msg, nargs, args);
+    SINK_PRINTF(out, "WARN: %s\n", msg->buf.str);
+
+    if (events && reporter->message)
+        reporter->message(events, tls_context->test, "warn", file, line, msg->buf.str + prefix);
+    va_end(args);
+}
+
+void _nt_info(_nt_uniq_t ident, const char *file, unsigned line, unsigned nargs, ...)
+{
+    va_list args;
+    va_start(args, nargs);
+
+    assert(tls_context);
+    scope_msg_capture(tls_context->scope_msg, ident, file, line, 0, nargs, args);
+
+    va_end(args);
+}
+
+void _nt_capture(_nt_uniq_t ident, const char *file, unsigned line, unsigned nargs, ...)
+{
+    if (!nargs)
+        return;
+
+    va_list args;
+    va_start(args, nargs);
+
+    assert(tls_context);
+    scope_msg_capture(tls_context->scope_msg, ident, file, line, 1, nargs, args);
+
+    va_end(args);
+}
+
+void _nt_scope_reset(void)
+{
+    scope_msg_reset(tls_context->scope_msg);
+}
+
+
+
+/* Test filter compiled to the list of literal segments (in lower case), which
+ * are separated by asterisks in the pattern: first segment must match at the
+ * beginning of the name, last segment must match at the end, other segments are
+ * searched in between, left to right (leftmost occurrence of each segment is
+ * always the best choice, so no backtracking is needed). The segments are
+ * searched with Knuth-Morris-Pratt algorithm, so each character of the name
+ * is looked at once or twice, whatever pattern is given. */
+struct segment {
+    const char *str;
+    size_t len;
+    const size_t *prefix;   /* length of longest proper prefix of str[0..n], which is its suffix */
+};
+
+struct filter {
+    int exclude;            /* pattern was given with '-' prefix */
+    unsigned nsegs;         /* number of asterisks plus one */
+    struct segment *segs;
+    char *text;
+    size_t *prefix;         /* prefix function of all segments */
+};
+
+struct filters {
+    struct filter *items;
+    unsigned count, capacity;
+    unsigned ninclude;      /* number of not excluding filters */
+};
+
+static struct filters filters;
+
+static void filters_add(struct filters *thiz, const char *pattern)
+{
+    if (thiz->count == thiz->capacity) {
+        thiz->capacity = thiz->capacity ? 2 * thiz->capacity : 16;
+        thiz->items = realloc(thiz->items, thiz->capacity * sizeof(*thiz->items));
+        if (!thiz->items) abort();
+    }
+
+    struct filter *filt = &thiz->items[thiz->count++];
+    filt->exclude = *pattern == '-';
+    thiz->ninclude += !filt->exclude;
+
+    filt->text = strdup(pattern + filt->exclude);
+    if (!filt->text) abort();
+
+    filt->nsegs = 1;
+    for (char *p = filt->text; *p; p++)
+        filt->nsegs += *p == '*';
+
+    filt->segs = malloc(filt->nsegs * sizeof(*filt->segs));
+    filt->prefix = malloc((strlen(filt->text) + 1) * sizeof(*filt->prefix));
+    if (!filt->segs || !filt->prefix) abort();
+
+    char *str = filt->text;
+    for (unsigned n = 0; n < filt->nsegs; n++)
+    {
+        struct segment *seg = &filt->segs[n];
+        size_t *prefix = &filt->prefix[str - filt->text];
+        seg->str = str;
+        seg->prefix = prefix;
+        while (*str && *str != '*') {
+            *str = ascii_lower(*str);
+            ++str;
+        }
+
+        seg->len = str - seg->str;
+        *str++ = 0;
+
+        prefix[0] = 0;
+        for (size_t i = 1, k = 0; i < seg->len; i++) {
+            while (k && seg->str[i] != seg->str[k])
+                k = prefix[k - 1];
+            k += seg->str[i] == seg->str[k];
+            prefix[i] = k;
+        }
+    }
+}
+
+static int segment_equal(const char *str, const struct segment *seg)
+{
+    for (size_t n = 0; n < seg->len; n++)
+        if (ascii_lower(str[n]) != seg->str[n])
+            return 0;
+
+    return 1;
+}
+
+/* Returns the end of the leftmost occurrence of the segment in [str, end), or NULL. */
+static const char* segment_find(const char *str, const char *end, const struct segment *seg)
+{
+    if (!seg->len)
+        return str;
+
+    for (size_t k = 0; str != end; str++)
+    {
+        char c = ascii_lower(*str);
+        while (k && c != seg->str[k])
+            k = seg->prefix[k - 1];
+
+        if (c == seg->str[k] && ++k == seg->len)
+            return str + 1;
+    }
+
+    return NULL;
+}
+
+static int filter_match(const struct filter *filt, const char *name)
+{
+    const struct segment *first = &filt->segs[0], *last = &filt->segs[filt->nsegs - 1];
+    size_t len = strlen(name);
+
+    if (filt->nsegs == 1)
+        return len == first->len && segment_equal(name, first);
+
+    if (len < first->len + last->len || !segment_equal(name, first)
+        || !segment_equal(&name[len - last->len], last))
+    {
+        return 0;
+    }
+
+    const char *str = name + first->len, *end = name + len - last->len;
+    for (const struct segment *seg = first + 1; seg != last; seg++)
+        if (!(str = segment_find(str, end, seg)))
+            return 0;
+
+    return 1;
+}
+
+/* Test is selected, if it matches any of including filters (or there are
+ * no including filters at all), and doesn't match any of excluding filters. */
+static int select_test(const struct _nt_test *test, const struct filters *filters)
+{
+    int selected = !filters->ninclude;
+    for (const struct filter *filt = filters->items; filt != &filters->items[filters->count]; filt++)
+    {
+        if (filt->exclude) {
+            if (filter_match(filt, test->name))
+                return 0;
+        }
+        else if (!selected)
+            selected = filter_match(filt, test->name);
+    }
+
+    return selected;
+}
+
+static void filters_free(struct filters *thiz)
+{
+    for (unsigned n = 0; n < thiz->count; n++)
+        free(thiz->items[n].text), free(thiz->items[n].segs), free(thiz->items[n].prefix);
+
+    free(thiz->items);
+}
+
+/* Write the string with characters escaped for XML text or attribute. */
+static void xml_escape(struct sink *sink, const char *str)
+{
+    for (; *str; str++)
+    {
+        unsigned char c = *str;
+        if (c == '&')
+            SINK_PRINTF(sink, "&amp;");
+        else if (c == '<')
+            SINK_PRINTF(sink, "&lt;");
+        else if (c == '>')
+            SINK_PRINTF(sink, "&gt;");
+        else if (c == '"')
+            SINK_PRINTF(sink, "&quot;");
+        else if (c == '\n' || c == '\t')
+            SINK_PRINTF(sink, "&#%u;", c);
+        else if (c < ' ')
+            SINK_PRINTF(sink, "\\x%02x", c);  /* not allowed in XML 1.0 */
+        else
+            SINK_PRINTF(sink, "%c", c);
+    }
+}
+
+/* JUnit XML: all tests are reported in single <testsuite>, class name of the
+ * test case is the name of the test suite. Numbers of tests, failures, etc...
+ * aren't known when the report is streamed and aren't written. */
+static void junit_begin(struct sink *sink, const struct _nt_test *const *tests, unsigned ntests)
+{
+    (void)tests, (void)ntests;
+
+    const char *name = strrchr(argv0, '/');
+    SINK_PRINTF(sink, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n<testsuite name=\"");
+    xml_escape(sink, name ? name + 1 : argv0);
+    SINK_PRINTF(sink, "\">\n");
+}
+
+static void junit_testcase(struct sink *sink, const struct _nt_test *test)
+{
+    const char *name = strchr(test->name, '/');
+    SINK_PRINTF(sink, "  <testcase classname=\"");
+    xml_escape(sink, test_suite(test, 0)->name);
+    SINK_PRINTF(sink, "\" name=\"");
+    xml_escape(sink, name ? name + 1 : test->name);
+    SINK_PRINTF(sink, "\" file=\"");
+    xml_escape(sink, test->file);
+    SINK_PRINTF(sink, "\" line=\"%u\"", test->line);
+}
+
+/* Opening tag of the running test is the only event, crash handler closes it
+ * with an error, so the crashed test is in the report. The tag is dropped when
+ * the test is finished. */
+static void junit_start(struct sink *sink, const struct _nt_test *test)
+{
+    junit_testcase(sink, test);
+    SINK_PRINTF(sink, ">\n");
+}
+
+static void junit_test(struct sink *sink, const struct _nt_test *test, const struct result *result)
+{
+    junit_testcase(sink, test);
+    SINK_PRINTF(sink, " time=\"%.6f\">\n", result->duration / 1e9);
+
+    const char *msg = result->first.fail_msg;
+    switch (result->status)
+    {
+    case TEST_FAILED:
+        SINK_PRINTF(sink, "    <failure message=\"");
+        xml_escape(sink, msg && *msg ? msg : "failed");
+        SINK_PRINTF(sink, "\"/>\n");
+        break;
+
+    case TEST_SKIPPED:
+        SINK_PRINTF(sink, "    <skipped message=\"");
+        xml_escape(sink, result->skip_msg ? result->skip_msg : "");
+        SINK_PRINTF(sink, "\"/>\n");
+        break;
+
+    case TEST_CRASHED:
+        /* description of the crash is the last failure */
+        msg = result->last.fail_msg;
+        SINK_PRINTF(sink, "    <error type=\"crash\" message=\"");
+        xml_escape(sink, msg && *msg ? msg : "test crashed");
+        SINK_PRINTF(sink, "\"/>\n");
+        break;
+
+    case TEST_TIMEOUT:
+        SINK_PRINTF(sink, "    <error type=\"timeout\" message=\"timed out after %g seconds\"/>\n",
+            test_timeout(test));
+        break;
+
+    case TEST_PASSED:
+        break;
+    }
+
+    if (result->info && *result->info) {
+        SINK_PRINTF(sink, "    <system-out>");
+        xml_escape(sink, result->info);
+        SINK_PRINTF(sink, "</system-out>\n");
+    }
+
+    SINK_PRINTF(sink, "  </testcase>\n");
+}
+
+static void junit_end(struct sink *sink)
+{
+    SINK_PRINTF(sink, "</testsuite>\n</testsuites>\n");
+}
+
+/* Write the string as JSON string (with quotes). */
+static void json_string(struct sink *sink, const char *str)
+{
+    SINK_PRINTF(sink, "\"");
+    for (; *str; str++)
+    {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            SINK_PRINTF(sink, "\\%c", c);
+        else if (c == '\n')
+            SINK_PRINTF(sink, "\\n");
+        else if (c == '\t')
+            SINK_PRINTF(sink, "\\t");
+        else if (c < ' ')
+            SINK_PRINTF(sink, "\\u%04x", c);
+        else
+            SINK_PRINTF(sink, "%c", c);
+    }
+    SINK_PRINTF(sink, "\"");
+}
+
+/* Line delimited JSON: each event is JSON object on separate line,
+ * "event" member is one of "start", "failure", "warn", "skip", "end". */
+static void jsonl_event(struct sink *sink, const char *event, const struct _nt_test *test)
+{
+    SINK_PRINTF(sink, "{\"event\":\"%s\",\"test\":", event);
+    json_string(sink, test->name);
+}
+
+static void jsonl_begin(struct sink *sink, const struct _nt_test *const *tests, unsigned ntests)
+{
+    (void)sink, (void)tests, (void)ntests;
+}
+
+static void jsonl_start(struct sink *sink, const struct _nt_test *test)
+{
+    jsonl_event(sink, "start", test);
+    SINK_PRINTF(sink, ",\"suite\":");
+    json_string(sink, test_suite(test, 0)->name);
+    SINK_PRINTF(sink, ",\"file\":");
+    json_string(sink, test->file);
+    SINK_PRINTF(sink, ",\"line\":%u}\n", test->line);
+}
+
+static void jsonl_failure(struct sink *sink, const struct _nt_test *test, const struct failure *failure)
+{
+    jsonl_event(sink, "failure", test);
+    SINK_PRINTF(sink, ",\"file\":");
+    json_string(sink, failure->file);
+    SINK_PRINTF(sink, ",\"line\":%u,\"assertion\":", failure->line);
+    json_string(sink, failure->name);
+    if (failure->op) {
+        SINK_PRINTF(sink, ",\"op\":");
+        json_string(sink, failure->op);
+    }
+
+    SINK_PRINTF(sink, ",\"left\":{\"expr\":");
+    json_string(sink, failure->left_expr);
+    SINK_PRINTF(sink, ",\"value\":");
+    json_string(sink, failure->left_value);
+    SINK_PRINTF(sink, "}");
+
+    if (failure->right_expr) {
+        SINK_PRINTF(sink, ",\"right\":{\"expr\":");
+        json_string(sink, failure->right_expr);
+        SINK_PRINTF(sink, ",\"value\":");
+        json_string(sink, failure->right_value);
+        SINK_PRINTF(sink, "}");
+    }
+
+    SINK_PRINTF(sink, ",\"nofail\":%s}\n", failure->nofail ? "true" : "false");
+}
+
+static void jsonl_message(struct sink *sink, const struct _nt_test *test,
+                            const char *event, const char *file, unsigned line, const char *text)
+{
+    jsonl_event(sink, event, test);
+    SINK_PRINTF(sink, ",\"file\":");
+    json_string(sink, file);
+    SINK_PRINTF(sink, ",\"line\":%u,\"message\":", line);
+    json_string(sink, text);
+    SINK_PRINTF(sink, "}\n");
+}
+
+static void jsonl_test(struct sink *sink, const struct _nt_test *test, const struct result *result)
+{
+    /* start event is lost if the worker process crashed */
+    if (result->events && *result->events)
+        SINK_PRINTF(sink, "%s", result->events);
+    else
+        jsonl_start(sink, test);
+
+    const struct timing *t = &result->timing;
+    jsonl_event(sink, "end", test);
+    SINK_PRINTF(sink, ",\"status\":\"%s\",\"duration\":%.6f"
+        ",\"setup\":%.6f,\"run\":%.6f,\"teardown\":%.6f",
+        status_names[result->status], result->duration / 1e9,
+        t->wall[PHASE_SETUP] / 1e9, t->wall[PHASE_TEST] / 1e9, t->wall[PHASE_TEARDOWN] / 1e9);
+
+    if (durations)
+        SINK_PRINTF(sink, ",\"cpu\":{\"setup\":%.6f,\"run\":%.6f,\"teardown\":%.6f}",
+            t->cpu[PHASE_SETUP] / 1e9, t->cpu[PHASE_TEST] / 1e9, t->cpu[PHASE_TEARDOWN] / 1e9);
+
+    if (result->first.fail_msg && *result->first.fail_msg) {
+        SINK_PRINTF(sink, ",\"message\":");
+        json_string(sink, result->first.fail_msg);
+    }
+
+    SINK_PRINTF(sink, "}\n");
+}
+
+static void jsonl_end(struct sink *sink)
+{
+    (void)sink;
+}
+
+/* Binary log: header, string table, then fixed size records of the tests
+ * (in native byte order). The records are appended when the tests finish,
+ * the string table contains the names of all tests to run, so it is written
+ * before the records. Number of the records is determined by size of the file
+ * (incomplete record at the end of the log of crashed run is ignored). The log
+ * might be mapped to memory and scanned without parsing.
+ *
+ * Strings, which aren't known in advance (files of the failures outside of the
+ * test files and assertion sites), are appended as pseudo-record with LOG_STRINGS status: `name`
+ * is the size of the strings following the record (which are padded to the
+ * size of the record), and the strings continue the string table. */
+
+#define LOG_MAGIC "NTLOG\0\0\0"
+enum { LOG_VERSION = 2, LOG_NONE = 0xffffffff, LOG_STRINGS = 0xfffffffe };
+
+struct log_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t strings_offset, strings_size;
+    uint64_t records_offset;
+    uint64_t time;              /* start of the run, seconds since the Epoch */
+};
+
+struct log_record {
+    uint32_t name, suite, file; /* offsets of the strings in the string table */
+    uint32_t line;
+    uint32_t status;            /* see enum status */
+    uint32_t fail_file;         /* LOG_NONE if the test didn't fail, or the file is unknown */
+    uint32_t fail_line;
+    uint32_t reserved;
+    uint64_t duration;          /* nanoseconds */
+    uint64_t wall[NUM_PHASES];  /* time of setup, test and teardown, nanoseconds */
+};
+
+/* String table of the binary log, strings are found via open addressing hash. */
+static struct strtab {
+    char *data;
+    size_t size, capacity;
+    uint32_t *slots;            /* offsets of the strings plus one, 0 for empty slot */
+    size_t nslots, count;
+} strtab;
+
+static uint32_t* strtab_slot(struct strtab *thiz, const char *str)
+{
+    size_t n = string_hash(str) & (thiz->nslots - 1);
+    while (thiz->slots[n] && strcmp(&thiz->data[thiz->slots[n] - 1], str))
+        n = (n + 1) & (thiz->nslots - 1);
+
+    return &thiz->slots[n];
+}
+
+static uint32_t strtab_add(struct strtab *thiz, const char *str)
+{
+    if ((thiz->count + 1) * 2 > thiz->nslots)
+    {
+        struct strtab old = *thiz;
+        thiz->nslots = old.nslots ? old.nslots * 2 : 256;
+        thiz->slots = (uint32_t*)calloc(thiz->nslots, sizeof(*thiz->slots));
+        if (!thiz->slots) abort();
+
+        for (size_t n = 0; n < old.nslots; n++)
+            if (old.slots[n])
+                *strtab_slot(thiz, &thiz->data[old.slots[n] - 1]) = old.slots[n];
+
+        free(old.slots);
+    }
+
+    uint32_t *slot = strtab_slot(thiz, str);
+    if (*slot)
+        return *slot - 1;
+
+    size_t len = strlen(str) + 1;
+    if (thiz->size + len > thiz->capacity) {
+        thiz->capacity = (thiz->size + len) * 2;
+        thiz->data = (char*)realloc(thiz->data, thiz->capacity);
+        if (!thiz->data) abort();
+    }
+
+    memcpy(&thiz->data[thiz->size], str, len);
+    *slot = thiz->size + 1;
+    thiz->size += len;
+    thiz->count++;
+    return *slot - 1;
+}
+
+static uint32_t strtab_find(struct strtab *thiz, const char *str)
+{
+    uint32_t *slot = str && thiz->nslots ? strtab_slot(thiz, str) : NULL;
+    return slot && *slot ? *slot - 1 : LOG_NONE;
+}
+
+static void strtab_free(struct strtab *thiz)
+{
+    free(thiz->data), free(thiz->slots);
+    memset(thiz, 0, sizeof(*thiz));
+}
+
+static void binary_begin(struct sink *sink, const struct _nt_test *const *tests, unsigned ntests)
+{
+    for (unsigned n = 0; n < ntests; n++) {
+        strtab_add(&strtab, tests[n]->name);
+        strtab_add(&strtab, test_suite(tests[n], 0)->name);
+        strtab_add(&strtab, tests[n]->file);
+    }
+
+    /* assertions might fail outside of the test files (in helper headers) */
+    const struct _nt_site *const *sites;
+    for (size_t n = 0, nsites = all_sites(&sites); n < nsites; n++)
+        strtab_add(&strtab, sites[n]->file);
+
+    /* records are aligned to 8 bytes */
+    static const char padding[8];
+    size_t strings_offset = sizeof(struct log_header);
+    size_t records_offset = (strings_offset + strtab.size + 7) & ~(size_t)7;
+
+    struct log_header header = {
+        LOG_MAGIC, LOG_VERSION, sizeof(struct log_record),
+        strings_offset, strtab.size, records_offset, (uint64_t)time(NULL)
+    };
+
+    sink_write(sink, &header, sizeof(header));
+    sink_write(sink, strtab.data, strtab.size);
+    sink_write(sink, padding, records_offset - strings_offset - strtab.size);
+}
+
+/* Append the string, which is missing in the string table, to the log. */
+static uint32_t binary_string(struct sink *sink, const char *str)
+{
+    static const char padding[sizeof(struct log_record)];
+    uint32_t offset = strtab_add(&strtab, str);
+    uint32_t len = strtab.size - offset;
+    uint32_t size = (len + sizeof(padding) - 1) / sizeof(padding) * sizeof(padding);
+
+    struct log_record chunk;
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.name = len;
+    chunk.status = LOG_STRINGS;
+
+    sink_write(sink, &chunk, sizeof(chunk));
+    sink_write(sink, &strtab.data[offset], len);
+    sink_write(sink, padding, size - len);
+    return offset;
+}
+
+static void binary_test(struct sink *sink, const struct _nt_test *test, const struct result *result)
+{
+    /* crashed or timed out test might have no location of the failure */
+    const char *fail_file = NULL;
+    unsigned fail_line = 0;
+    if (result->status == TEST_FAILED || result->status == TEST_CRASHED || result->status == TEST_TIMEOUT) {
+        fail_file = result->first.fail_file ? result->first.fail_file : test->file;
+        fail_line = result->first.fail_file ? result->first.fail_line : test->line;
+    }
+
+    uint32_t fail_offset = fail_file ? strtab_find(&strtab, fail_file) : LOG_NONE;
+    if (fail_file && fail_offset == LOG_NONE)
+        fail_offset = binary_string(sink, fail_file);
+
+    struct log_record record = {
+        strtab_find(&strtab, test->name), strtab_find(&strtab, test_suite(test, 0)->name),
+        strtab_find(&strtab, test->file), test->line, result->status,
+        fail_offset, fail_line, 0, result->duration,
+        {result->timing.wall[PHASE_SETUP], result->timing.wall[PHASE_TEST], result->timing.wall[PHASE_TEARDOWN]}
+    };
+
+    sink_write(sink, &record, sizeof(record));
+}
+
+static void binary_end(struct sink *sink)
+{
+    (void)sink;
+    strtab_free(&strtab);
+}
+
+static const struct reporter reporters[] = {
+    {"junit", junit_begin, junit_test, junit_end, "</testsuite>\n</testsuites>\n",
+        "    <error type=\"crash\"/>\n  </testcase>\n", junit_start, NULL, NULL},
+    {"jsonl", jsonl_begin, jsonl_test, jsonl_end, "", "", jsonl_start, jsonl_failure, jsonl_message},
+    {"binary", binary_begin, binary_test, binary_end, "", "", NULL, NULL, NULL},
+};
+
+/* Open the report file, text output goes to stderr if the report is printed to stdout. */
+static void report_begin(const struct _nt_test *const *tests, unsigned ntests)
+{
+    if (!reporter)
+        return;
+
+    FILE *file = stdout;
+    if (report_file && strcmp(report_file, "-") && !(file = fopen(report_file, "wb"))) {
+        perror(report_file);
+        exit(EXIT_FAILURE);
+    }
+
+    if (file == stdout)
+        text_sink.fd = fileno(stderr), text_sink.file = stderr;
+
+    report_sink.fd = fileno(file), report_sink.file = file;
+    reporter->begin(&report_sink, tests, ntests);
+}
+
+static void report_end(void)
+{
+    if (!reporter)
+        return;
+
+    reporter->end(&report_sink);
+    sink_flush(&report_sink);
+    if (report_sink.file != stdout)
+        fclose(report_sink.file);
+
+    sink_free(&report_sink);
+    report_sink.fd = -1, report_sink.file = NULL;
+}
+
+/* Binary logs given with --read-log option. */
+static const char **log_files;
+static unsigned nlog_files;
+
+struct log_file {
+    char *data;
+    size_t size;
+    const struct log_header *header;
+    char *strings;              /* string table with the appended strings */
+    size_t strings_size;
+    struct log_record *records; /* records of the tests (aligned copy) */
+    size_t nrecords;
+};
+
+static void log_load(struct log_file *thiz, const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+
+    thiz->data = NULL, thiz->size = 0;
+    size_t capacity = 0, len;
+    do {
+        if (thiz->size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 16;
+            thiz->data = (char*)realloc(thiz->data, capacity);
+            if (!thiz->data) abort();
+        }
+
+        len = fread(&thiz->data[thiz->size], 1, capacity - thiz->size, f);
+        thiz->size += len;
+    } while (len);
+
+    fclose(f);
+
+    const struct log_header *h = thiz->header = (const struct log_header*)thiz->data;
+    if (thiz->size < sizeof(*h) || memcmp(h->magic, LOG_MAGIC, sizeof(h->magic))
+        || h->version != LOG_VERSION || h->record_size != sizeof(struct log_record)
+        || h->strings_offset + h->strings_size > h->records_offset || h->records_offset > thiz->size
+        || (h->strings_size && thiz->data[h->strings_offset + h->strings_size - 1]))
+    {
+        fprintf(stderr, "%s: '%s': invalid log file\n", argv0, name);
+        exit(EXIT_FAILURE);
+    }
+
+    thiz->strings_size = h->strings_size;
+    thiz->strings = (char*)malloc(h->strings_size + 1);
+    size_t max_records = (thiz->size - h->records_offset) / sizeof(struct log_record);
+    thiz->records = (struct log_record*)malloc((max_records + 1) * sizeof(struct log_record));
+    if (!thiz->strings || !thiz->records) abort();
+    memcpy(thiz->strings, &thiz->data[h->strings_offset], h->strings_size);
+
+    thiz->nrecords = 0;
+    for (size_t pos = h->records_offset; pos + sizeof(struct log_record) <= thiz->size; )
+    {
+        struct log_record *r = &thiz->records[thiz->nrecords];
+        memcpy(r, &thiz->data[pos], sizeof(*r));
+        pos += sizeof(*r);
+
+        if (r->status != LOG_STRINGS) {
+            thiz->nrecords++;
+            continue;
+        }
+
+        /* strings are appended to the string table */
+        size_t size = (r->name + sizeof(*r) - 1) / sizeof(*r) * sizeof(*r);
+        if (size > thiz->size - pos || (r->name && thiz->data[pos + r->name - 1])) {
+            fprintf(stderr, "%s: '%s': invalid log file\n", argv0, name);
+            exit(EXIT_FAILURE);
+        }
+
+        thiz->strings = (char*)realloc(thiz->strings, thiz->strings_size + r->name + 1);
+        if (!thiz->strings) abort();
+        memcpy(&thiz->strings[thiz->strings_size], &thiz->data[pos], r->name);
+        thiz->strings_size += r->name;
+        pos += size;
+    }
+}
+
+/* Returns the string from the string table, or NULL. */
+static const char* log_string(const struct log_file *thiz, uint32_t offset)
+{
+    if (offset == LOG_NONE)
+        return NULL;
+
+    if (offset >= thiz->strings_size || !memchr(&thiz->strings[offset], 0, thiz->strings_size - offset)) {
+        fprintf(stderr, "%s: invalid string in the log file\n", argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    return &thiz->strings[offset];
+}
+
+/* Read binary logs and write the results with the reporter, or as text,
+ * the logs are merged if binary reporter is used. */
+static int read_logs(void)
+{
+    struct log_file *logs = (struct log_file*)malloc((nlog_files + 1) * sizeof(*logs));
+    if (!logs) abort();
+
+    size_t count = 0;
+    for (unsigned n = 0; n < nlog_files; n++) {
+        log_load(&logs[n], log_files[n]);
+        count += logs[n].nrecords;
+    }
+
+    /* the tests are made up from the records, so the reporters can use them */
+    struct _nt_test *tests = (struct _nt_test*)malloc((count + 1) * sizeof(*tests));
+    struct _nt_suite *suites = (struct _nt_suite*)malloc((count + 1) * sizeof(*suites));
+    const struct _nt_test **list = (const struct _nt_test**)malloc((count + 1) * sizeof(*list));
+    struct log_record *records = (struct log_record*)malloc((count + 1) * sizeof(*records));
+    const char **fail_files = (const char**)malloc((count + 1) * sizeof(*fail_files));
+    if (!tests || !suites || !list || !records || !fail_files) abort();
+
+    size_t k = 0;
+    for (unsigned n = 0; n < nlog_files; n++)
+    {
+        const struct log_file *log = &logs[n];
+        for (size_t i = 0; i < log->nrecords; i++, k++)
+        {
+            records[k] = log->records[i];
+            const struct log_record *r = &records[k];
+
+            const char *name = log_string(log, r->name), *file = log_string(log, r->file);
+            struct _nt_suite suite = {log_string(log, r->suite), 0, NULL, NULL, NULL};
+            memcpy(&suites[k], &suite, sizeof(suite));
+
+            struct _nt_test test = {file ? file : "", r->line, NULL, name ? name : "", &suites[k], {0}, NULL};
+            memcpy(&tests[k], &test, sizeof(test));
+            list[k] = &tests[k];
+            fail_files[k] = log_string(log, r->fail_file);
+
+            if (!suite.name || r->status > TEST_TIMEOUT) {
+                fprintf(stderr, "%s: '%s': invalid record %zu\n", argv0, log_files[n], i);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    report_begin(list, count);
+
+    unsigned nfails = 0;
+    for (k = 0; k < count; k++)
+    {
+        const struct log_record *r = &records[k];
+        struct result result = {(enum status)r->status, r->duration,
+            {{r->wall[PHASE_SETUP], r->wall[PHASE_TEST], r->wall[PHASE_TEARDOWN]}, {0}},
+            {fail_files[k], r->fail_line, NULL}, {NULL, 0, NULL}, NULL, NULL, NULL};
+
+        nfails += result.status == TEST_FAILED || result.status == TEST_CRASHED
+                    || result.status == TEST_TIMEOUT;
+
+        if (reporter)
+            reporter->test(&report_sink, list[k], &result);
+        else if (result.first.fail_file)
+            SINK_PRINTF(out, "%s %s (%.3f ms) at %s:%u\n", status_names[result.status],
+                list[k]->name, result.duration / 1e6, result.first.fail_file, result.first.fail_line);
+        else
+            SINK_PRINTF(out, "%s %s (%.3f ms)\n", status_names[result.status],
+                list[k]->name, result.duration / 1e6);
+    }
+
+    report_end();
+
+    SINK_PRINTF(out, "%u/%u tests passed, %u tests failed.\n", (unsigned)count - nfails, (unsigned)count, nfails);
+    sink_flush(out);
+
+    for (unsigned n = 0; n < nlog_files; n++)
+        free(logs[n].data), free(logs[n].strings), free(logs[n].records);
+
+    free(logs), free(tests), free(suites), free(list), free(records), free(fail_files);
+    return nfails != 0;
+}
+
+/* Output of the test, which waits until output of preceding tests is printed. */
+struct output {
+    char *text;
+    size_t len;
+    int ready;
+};
+
+/* Queue of the tests shared between all worker threads, tests are taken
+ * from the queue in order, so longest tests must be placed first. */
+struct runner {
+    const struct _nt_test **tests;
+    struct result *results;     /* messages are freed when the result is reported */
+    struct output *outputs;
+    unsigned ntests;
+    unsigned next;
+    unsigned emitted;           /* number of tests which output is printed */
+    unsigned nfails;
+#ifdef __unix__
+    pthread_mutex_t lock;
+#endif
+};
+
+/* Record result and output of n-th test (the text is freed later). Results and
+ * output are printed in the order of the tests rather than in the order of
+ * completion, so the output of parallel run is deterministic. The text is NULL
+ * if the output is already printed. Must be called with the lock held. */
+static void finish_test(struct runner *runner, unsigned n, struct result *result, char *text, size_t len)
+{
+    runner->nfails += result->status == TEST_FAILED || result->status == TEST_CRASHED
+                        || result->status == TEST_TIMEOUT;
+    runner->results[n] = *result;
+    runner->outputs[n] = (struct output){text, len, 1};
+
+    for (; runner->emitted < runner->ntests && runner->outputs[runner->emitted].ready; runner->emitted++)
+    {
+        unsigned k = runner->emitted;
+        struct output *output = &runner->outputs[k];
+        if (output->text) {
+            fwrite(output->text, 1, output->len, text_sink.file);
+            free(output->text);
+            output->text = NULL;
+        }
+
+        if (reporter)
+            reporter->test(&report_sink, runner->tests[k], &runner->results[k]);
+
+        result_free(&runner->results[k]);
+    }
+
+    fflush(text_sink.file);
+}
+
+
+/* History of previous runs kept in the state file: each line contains
+ * name of the test, its duration in nanoseconds and 1 if the test failed
+ * (older state files have no third column). */
+struct history_entry {
+    char *name;
+    unsigned long long duration;
+    int failed;
+};
+
+struct history {
+    struct history_entry *entries;
+    size_t count, capacity;
+    size_t sorted;      /* number of entries sorted by name */
+};
+
+static int history_cmp(const void *left, const void *right)
+{
+    return strcmp(((const struct history_entry*)left)->name,
+                  ((const struct history_entry*)right)->name);
+}
+
+static struct history_entry* history_find(struct history *thiz, const char *name)
+{
+    struct history_entry key = {(char*)(intptr_t)name, 0, 0};
+    return (struct history_entry*)bsearch(&key,
+                thiz->entries, thiz->sorted, sizeof(key), history_cmp);
+}
+
+static struct history_entry* history_add(struct history *thiz, const char *name)
+{
+    if (thiz->count == thiz->capacity) {
+        thiz->capacity = thiz->capacity ? 2 * thiz->capacity : 256;
+        thiz->entries = realloc(thiz->entries, thiz->capacity * sizeof(*thiz->entries));
+        if (!thiz->entries) abort();
+    }
+
+    struct history_entry *entry = &thiz->entries[thiz->count++];
+    entry->name = strdup(name);
+    entry->duration = 0;
+    entry->failed = 0;
+    if (!entry->name) abort();
+    return entry;
+}
+
+static void history_load(struct history *thiz, const char *file)
+{
+    FILE *f = fopen(file, "r");
+    if (f) {
+        char line[LINE_MAX], name[LINE_MAX];
+        unsigned long long duration;
+        int failed = 0;
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "%s %llu %d", name, &duration, &failed) >= 2) {
+                struct history_entry *entry = history_add(thiz, name);
+                entry->duration = duration;
+                entry->failed = failed;
+                failed = 0;
+            }
+
+        fclose(f);
+    }
+
+    qsort(thiz->entries, thiz->count, sizeof(*thiz->entries), history_cmp);
+    thiz->sorted = thiz->count;
+}
+
+/* Write the history to temporary file, then replace the state file,
+ * so the state file can't be damaged by concurrent test runs. */
+static void history_save(struct history *thiz, const char *file)
+{
+    qsort(thiz->entries, thiz->count, sizeof(*thiz->entries), history_cmp);
+    thiz->sorted = thiz->count;
+
+    _nt_print_t tmp = (_nt_print_t)MAKE_STRING_BUF(FILENAME_MAX + 4);
+    _NT_PRINTF(tmp, "%s.tmp", file);
+
+    FILE *f = fopen(tmp->buf.str, "w");
+    if (!f) {
+        perror(tmp->buf.str);
+        return;
+    }
+
+    for (size_t n = 0; n < thiz->count; n++)
+        fprintf(f, "%s %llu %d\n", thiz->entries[n].name, thiz->entries[n].duration, thiz->entries[n].failed);
+
+    if (fclose(f) || rename(tmp->buf.str, file) < 0)
+        perror(file);
+}
+
+static void history_free(struct history *thiz)
+{
+    for (size_t n = 0; n < thiz->count; n++)
+        free(thiz->entries[n].name);
+
+    free(thiz->entries);
+}
+
+struct schedule {
+    unsigned long long duration;
+    unsigned order;
+    const struct _nt_test *test;
+};
+
+static int schedule_cmp(const void *left, const void *right)
+{
+    const struct schedule *l = (const struct schedule*)left, *r = (const struct schedule*)right;
+    if (l->duration != r->duration)
+        return l->duration < r->duration ? 1 : -1;
+
+    return l->order < r->order ? -1 : l->order > r->order;
+}
+
+/* Order the tests by duration of the previous run, longest tests first (tests
+ * without history are considered longest), this minimizes total run time
+ * when the tests are taken by parallel workers from shared queue. */
+static void schedule_tests(struct runner *runner, struct history *history)
+{
+    struct schedule *sched = malloc((runner->ntests + 1) * sizeof(*sched));
+    if (!sched) abort();
+
+    for (unsigned n = 0; n < runner->ntests; n++) {
+        struct history_entry *entry = history_find(history, runner->tests[n]->name);
+        sched[n] = (struct schedule){entry ? entry->duration : ULLONG_MAX, n, runner->tests[n]};
+    }
+
+    qsort(sched, runner->ntests, sizeof(*sched), schedule_cmp);
+
+    for (unsigned n = 0; n < runner->ntests; n++)
+        runner->tests[n] = sched[n].test;
+
+    free(sched);
+}
+
+/* Assign the tests to the shards: by hash of the name, or, if durations of
+ * the tests are recorded in the history, by greedy bin packing (longest tests
+ * first, each test to the least loaded shard), so all shards take about the
+ * same time. Unknown tests are considered to take average time. The result
+ * depends only on the list of tests and the history, so all the shards get
+ * the same assignment. */
+static void assign_shards(const struct _nt_test **tests, unsigned ntests,
+                            struct history *history, unsigned *shards)
+{
+    struct schedule *sched = malloc((ntests + 1) * sizeof(*sched));
+    unsigned long long *loads = calloc(shard_count, sizeof(*loads));
+    if (!sched || !loads) abort();
+
+    unsigned long long total = 0;
+    unsigned nknown = 0;
+    for (unsigned n = 0; n < ntests; n++) {
+        struct history_entry *entry = history_find(history, tests[n]->name);
+        sched[n] = (struct schedule){entry ? entry->duration : ULLONG_MAX, n, tests[n]};
+        if (entry)
+            total += entry->duration, nknown++;
+    }
+
+    if (!nknown) {
+        for (unsigned n = 0; n < ntests; n++)
+            shards[n] = string_hash(tests[n]->name) % shard_count;
+    }
+    else {
+        for (unsigned n = 0; n < ntests; n++)
+            if (sched[n].duration == ULLONG_MAX)
+                sched[n].duration = total / nknown;
+
+        qsort(sched, ntests, sizeof(*sched), schedule_cmp);
+
+        for (unsigned n = 0; n < ntests; n++) {
+            unsigned min = 0;
+            for (unsigned k = 1; k < shard_count; k++)
+                if (loads[k] < loads[min])
+                    min = k;
+
+            loads[min] += sched[n].duration;
+            shards[sched[n].order] = min;
+        }
+    }
+
+    free(sched), free(loads);
+}
+
+/* Leave only the tests of current shard. */
+static void select_shard(const struct _nt_test **tests, unsigned *ntests, struct history *history)
+{
+    unsigned *shards = malloc((*ntests + 1) * sizeof(*shards));
+    if (!shards) abort();
+
+    assign_shards(tests, *ntests, history, shards);
+
+    unsigned count = 0;
+    for (unsigned n = 0; n < *ntests; n++)
+        if (shards[n] == shard_index)
+            tests[count++] = tests[n];
+
+    *ntests = count;
+    free(shards);
+}
+
+static void update_history(struct runner *runner, struct history *history)
+{
+    for (unsigned n = 0; n < runner->ntests; n++)
+    {
+        struct history_entry *entry = history_find(history, runner->tests[n]->name);
+        if (!entry)
+            entry = history_add(history, runner->tests[n]->name);
+
+        enum status status = runner->results[n].status;
+        entry->duration = runner->results[n].duration;
+        entry->failed = status == TEST_FAILED || status == TEST_CRASHED || status == TEST_TIMEOUT;
+    }
+}
+
+/* Move the tests failed in previous run to the beginning of the list (keeping
+ * order of the tests otherwise), or leave only failed tests if `only_failed`
+ * is set and there are such tests (otherwise all tests are left). */
+static void failed_tests_first(const struct _nt_test **tests, unsigned *ntests,
+                                struct history *history, int only_failed)
+{
+    const struct _nt_test **sorted = malloc((*ntests + 1) * sizeof(*sorted));
+    if (!sorted) abort();
+
+    unsigned count = 0;
+    for (unsigned n = 0; n < *ntests; n++) {
+        struct history_entry *entry = history_find(history, tests[n]->name);
+        if (entry && entry->failed)
+            sorted[count++] = tests[n];
+    }
+
+    if (!only_failed || !count) {
+        for (unsigned n = 0; n < *ntests; n++) {
+            struct history_entry *entry = history_find(history, tests[n]->name);
+            if (!entry || !entry->failed)
+                sorted[count++] = tests[n];
+        }
+    }
+
+    memcpy(tests, sorted, count * sizeof(*tests));
+    *ntests = count;
+    free(sorted);
+}
+
+#ifdef __unix__
+static void* worker_thread(void *arg)
+{
+    struct runner *runner = (struct runner*)arg;
+
+    struct sink sink = {NULL, 0, 0, -1, NULL, 0};
+    out = &sink;
+
+    alt_stack_init();
+    watchdog_attach();
+
+    while (1)
+    {
+        pthread_mutex_lock(&runner->lock);
+        unsigned n = runner->next < runner->ntests ? runner->next++ : runner->ntests;
+        pthread_mutex_unlock(&runner->lock);
+
+        if (n == runner->ntests)
+            break;
+
+        struct result result;
+        run_test(runner->tests[n], NULL, &result);
+
+        /* output of each test is written at once, buffer is passed to the runner */
+        pthread_mutex_lock(&runner->lock);
+        finish_test(runner, n, &result, sink.buf, sink.len);
+        pthread_mutex_unlock(&runner->lock);
+
+        sink.buf = NULL, sink.len = sink.size = 0;
+    }
+
+    watchdog_detach();
+    release_test_memory();
+    alt_stack_free();
+
+    out = NULL;
+    return NULL;
+}
+
+static void run_parallel(struct runner *runner)
+{
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    if (!threads) abort();
+
+    pthread_mutex_init(&runner->lock, NULL);
+
+    unsigned nthreads = 0;
+    while (nthreads < jobs && nthreads < runner->ntests) {
+        if (pthread_create(&threads[nthreads], NULL, worker_thread, runner))
+            break;
+        ++nthreads;
+    }
+
+    while (nthreads)
+        pthread_join(threads[--nthreads], NULL);
+
+    pthread_mutex_destroy(&runner->lock);
+    free(threads);
+}
+
+/* Tests isolation: tests run in pre-forked worker processes, which receive
+ * indices of the tests via pipe and send results back via other pipe.
+ * Worker is forked from the runner without exec, so pointers to static
+ * data (like file names) remain valid in the runner. If the worker
+ * crashes, the test is reported as crashed and new worker is started.
+ *
+ * In fork server mode (fork_batch != 0) the runner itself never runs tests
+ * and keeps pristine state after global initialization: each worker exits
+ * after running `fork_batch` tests and replaced by new copy-on-write fork
+ * of the runner, so each batch of tests starts from the same snapshot. */
+
+struct result_msg {
+    unsigned test;
+    enum status status;
+    unsigned long long duration;
+    struct timing timing;
+    const char *first_file, *last_file;
+    unsigned first_line, last_line;
+    size_t first_len, last_len, info_len, skip_len, events_len, out_len;    /* lengths of following strings */
+    size_t nhits;       /* number of following site_hits records */
+    int crashed;        /* struct crash follows the output (if test is UINT_MAX) */
+};
+
+struct worker {
+    pid_t pid;
+    int cmd;            /* pipe to send test indices to the worker */
+    int res;            /* pipe to receive results from the worker */
+    unsigned test;      /* index of running test, or UINT_MAX */
+    unsigned count;     /* number of tests given to the worker */
+    unsigned long long start;   /* time when the test was started */
+    unsigned long long deadline; /* time of the timeout, or 0 */
+    int timed_out;      /* the worker is terminated due to timeout */
+};
+
+/* Time given to the worker to send the output after SIGTERM, milliseconds. */
+enum { WORKER_TERM_GRACE = 1000 };
+
+static int read_all(int fd, void *data, size_t size)
+{
+    while (size) {
+        ssize_t len = read(fd, data, size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        data = (char*)data + len, size -= len;
+    }
+    return 0;
+}
+
+static char* read_string(int fd, size_t len)
+{
+    char *str = malloc(len + 1);
+    if (!str) abort();
+    if (read_all(fd, str, len) < 0) {
+        free(str);
+        return NULL;
+    }
+    str[len] = 0;
+    return str;
+}
+
+/* Executions of the assertions are counted in the worker process, the counters
+ * are sent to the runner after each test, as index of the site in the section
+ * and the count (only for executed sites), and then cleared. */
+struct site_hits {
+    size_t site;
+    unsigned long hits;
+};
+
+static size_t take_hits(struct site_hits **hits)
+{
+    const struct _nt_site *const *sites;
+    size_t nsites = all_sites(&sites), count = 0, size = 0;
+    for (size_t n = 0; n < nsites; n++)
+    {
+        if (!*sites[n]->hits)
+            continue;
+
+        if (count == size) {
+            size = size ? 2 * size : 64;
+            *hits = (struct site_hits*)realloc(*hits, size * sizeof(**hits));
+            if (!*hits) abort();
+        }
+
+        (*hits)[count++] = (struct site_hits){n, *sites[n]->hits};
+        *sites[n]->hits = 0;
+    }
+
+    return count;
+}
+
+/* Forked worker inherits the totals of the runner, they must not be sent back. */
+static void clear_hits(void)
+{
+    const struct _nt_site *const *sites;
+    size_t nsites = all_sites(&sites);
+    for (size_t n = 0; n < nsites; n++)
+        *sites[n]->hits = 0;
+}
+
+static int read_hits(int fd, size_t count)
+{
+    const struct _nt_site *const *sites;
+    size_t nsites = all_sites(&sites);
+    while (count--) {
+        struct site_hits hits;
+        if (read_all(fd, &hits, sizeof(hits)) < 0)
+            return -1;
+
+        if (hits.site < nsites)
+            *sites[hits.site]->hits += hits.hits;
+    }
+
+    return 0;
+}
+
+/* Pipe to send the results from the worker process, or -1 in the runner. */
+static int worker_res = -1;
+
+/* Handler of fatal signals: output of the current test, which is kept in
+ * the buffer, is written before the program is terminated. The worker process
+ * sends the output and the crash to the runner in the message with `test`
+ * equal to UINT_MAX. Only async-signal-safe functions might be called here
+ * (backtrace() is called once before, so it doesn't load libgcc here). */
+static void crash_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    static _Thread_local volatile sig_atomic_t nested;
+    struct crash *crash = &tls_crash;
+    (void)ucontext;
+
+    /* crash in the handler itself */
+    if (nested++)
+        signal(sig, SIG_DFL), raise(sig);
+
+    if (sig != SIGTERM && sig != SIGINT) {
+        crash->signal = sig;
+        crash->addr = is_fault_signal(sig) ? info->si_addr : NULL;
+        crash->nframes = 0;
+#ifdef HAVE_BACKTRACE
+        /* frames of the handler and of the signal trampoline are skipped */
+        void *frames[CRASH_FRAMES + 2];
+        int nframes = backtrace(frames, CRASH_FRAMES + 2);
+        for (int n = 2; n < nframes; n++)
+            crash->frames[crash->nframes++] = frames[n];
+#endif
+    }
+
+    /* attached thread can't jump to the stack of the test */
+    struct context *ctx = tls_context;
+    if (catch_crashes && ctx && !ctx->owner && crash->signal) {
+        ctx->status = TEST_CRASHED;
+        nested = 0;
+        long_jump(ctx->exception);
+    }
+
+    struct sink *sink = out;
+    if (worker_res >= 0 && ((sink && sink->len) || crash->signal))
+    {
+        struct result_msg msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.test = UINT_MAX, msg.out_len = sink ? sink->len : 0, msg.crashed = !!crash->signal;
+        if (!write_all(worker_res, &msg, sizeof(msg))
+            && !write_all(worker_res, sink ? sink->buf : "", msg.out_len)
+            && msg.crashed)
+        {
+            write_all(worker_res, crash, sizeof(*crash));
+        }
+
+        if (sink)
+            sink->len = 0;
+    }
+    else if (sink && sink->len)
+    {
+        write_all(sink->fd >= 0 ? sink->fd : STDOUT_FILENO, sink->buf, sink->len);
+        sink->len = 0;
+    }
+
+    /* the report is closed, so it remains valid */
+    if (report_sink.fd >= 0) {
+        write_all(report_sink.fd, report_sink.buf, report_sink.len);
+        if (events && events->len) {
+            write_all(report_sink.fd, events->buf, events->len);
+            write_all(report_sink.fd, reporter->crash, strlen(reporter->crash));
+        }
+        write_all(report_sink.fd, reporter->tail, strlen(reporter->tail));
+        report_sink.fd = -1;
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void catch_fatal_signals(void)
+{
+    static const int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM, SIGINT};
+
+#ifdef HAVE_BACKTRACE
+    void *frame;
+    backtrace(&frame, 1);
+#endif
+    alt_stack_init();
+
+    /* the handler isn't reset, since the test might be continued after the crash */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = crash_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+
+    for (unsigned n = 0; n < Size(signals); n++)
+        sigaction(signals[n], &sa, NULL);
+}
+
+static void worker_process(struct runner *runner, int cmd, int res)
+{
+    struct sink sink = {NULL, 0, 0, -1, NULL, 0};
+    out = &sink;
+    worker_res = res;
+    report_sink.fd = -1, report_sink.len = 0;
+
+    unsigned n, count = 0;
+    while ((!fork_batch || count++ < fork_batch)
+            && !read_all(cmd, &n, sizeof(n)) && n < runner->ntests)
+    {
+        struct result result;
+        run_test(runner->tests[n], NULL, &result);
+        fflush(stdout);
+
+        const char *first = result.first.fail_msg ? result.first.fail_msg : "";
+        const char *last = result.last.fail_msg ? result.last.fail_msg : "";
+        const char *info = result.info ? result.info : "";
+        const char *skip = result.skip_msg ? result.skip_msg : "";
+        const char *report = result.events ? result.events : "";
+        struct site_hits *hits = NULL;
+        struct result_msg msg = {
+            n, result.status, result.duration, result.timing,
+            result.first.fail_file, result.last.fail_file,
+            result.first.fail_line, result.last.fail_line,
+            strlen(first), strlen(last), strlen(info), strlen(skip), strlen(report), sink.len,
+            _nt_count_hits ? take_hits(&hits) : 0, 0
+        };
+
+        /* the output is cleared first, so crash handler doesn't send it again */
+        size_t len = sink.len;
+        sink.len = 0;
+
+        if (write_all(res, &msg, sizeof(msg)) < 0
+            || write_all(res, first, msg.first_len) < 0
+            || write_all(res, last, msg.last_len) < 0
+            || write_all(res, info, msg.info_len) < 0
+            || write_all(res, skip, msg.skip_len) < 0
+            || write_all(res, report, msg.events_len) < 0
+            || write_all(res, sink.buf, len) < 0
+            || write_all(res, hits, msg.nhits * sizeof(*hits)) < 0)
+        {
+            break;
+        }
+
+        free(hits);
+        result_free(&result);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+static int start_worker(struct runner *runner, struct worker *workers, unsigned nworkers, struct worker *w)
+{
+    int cmd[2], res[2];
+    if (pipe(cmd) < 0)
+        return -1;
+
+    if (pipe(res) < 0) {
+        close(cmd[0]), close(cmd[1]);
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(cmd[0]), close(cmd[1]), close(res[0]), close(res[1]);
+        return -1;
+    }
+
+    if (!pid) {
+        /* other workers must see end of file when the runner closes pipes */
+        for (unsigned i = 0; i < nworkers; i++)
+            if (workers[i].pid > 0)
+                close(workers[i].cmd), close(workers[i].res);
+
+        close(cmd[1]), close(res[0]);
+        if (_nt_count_hits)
+            clear_hits();
+
+        worker_process(runner, cmd[0], res[1]);
+    }
+
+    close(cmd[0]), close(res[1]);
+    w->pid = pid, w->cmd = cmd[1], w->res = res[0], w->test = UINT_MAX, w->count = 0;
+    return 0;
+}
+
+static int stop_worker(struct worker *w)
+{
+    int status = 0;
+    close(w->cmd), close(w->res);
+    while (waitpid(w->pid, &status, 0) < 0 && errno == EINTR);
+    w->pid = 0;
+    return status;
+}
+
+/* Receive result of the test from the worker. */
+static void receive_result(struct runner *runner, struct worker *w, unsigned long long start)
+{
+    const struct _nt_test *test = runner->tests[w->test];
+    struct result_msg msg;
+    char *output = NULL;
+    struct result result = {TEST_CRASHED, 0, {{0}, {0}}, {NULL, 0, NULL}, {NULL, 0, NULL}, NULL, NULL, NULL};
+
+    /* the worker, which is going to die, sends output of the test first */
+    struct crash crash = {0};
+    int received = !read_all(w->res, &msg, sizeof(msg));
+    if (received && msg.test == UINT_MAX) {
+        output = read_string(w->res, msg.out_len);
+        if (output && msg.crashed && read_all(w->res, &crash, sizeof(crash)) < 0)
+            crash.signal = 0;
+
+        received = output && !read_all(w->res, &msg, sizeof(msg));
+    }
+
+    if (!received
+        || !(result.first.fail_msg = read_string(w->res, msg.first_len))
+        || !(result.last.fail_msg = read_string(w->res, msg.last_len))
+        || !(result.info = read_string(w->res, msg.info_len))
+        || !(result.skip_msg = read_string(w->res, msg.skip_len))
+        || !(result.events = read_string(w->res, msg.events_len))
+        || !(output = read_string(w->res, msg.out_len))
+        || read_hits(w->res, msg.nhits) < 0)
+    {
+        /* worker terminated before sending the result */
+        int status = stop_worker(w);
+        struct sink sink = {NULL, 0, 0, -1, NULL, 0};
+        if (output)
+            SINK_PRINTF(&sink, "%s", output);
+        else
+            SINK_PRINTF(&sink, "running %s\n", test->name);
+
+        if (w->timed_out)
+            SINK_PRINTF(&sink, "Test %s TIMED OUT after %g seconds\n", test->name, test_timeout(test));
+        else if (crash.signal) {
+            /* the crash is reported same way as with --catch-crashes option */
+            struct sink text = {NULL, 0, 0, -1, NULL, 0};
+            print_crash(&text, &crash);
+            SINK_PRINTF(&sink, "Test %s CRASHED: %s\n", test->name, text.buf);
+            free(result.first.fail_msg);
+            result.first.fail_file = test->file, result.first.fail_line = test->line;
+            result.first.fail_msg = text.buf;
+            free(result.last.fail_msg);
+            result.last = result.first;
+            result.last.fail_msg = strdup(text.buf);
+        }
+        else if (WIFSIGNALED(status))
+            SINK_PRINTF(&sink, "Test %s CRASHED: killed by signal %d (%s)\n",
+                test->name, WTERMSIG(status), strsignal(WTERMSIG(status)));
+        else
+            SINK_PRINTF(&sink, "Test %s CRASHED: exited with code %d\n",
+                test->name, WEXITSTATUS(status));
+
+        free(output);
+        output = sink.buf, msg.out_len = sink.len;
+
+        result.status = TEST_CRASHED;
+        result.duration = time_ns() - start;
+
+        /* worker was killed by the runner due to timeout */
+        if (w->timed_out)
+            result.status = TEST_TIMEOUT;
+    }
+    else {
+        result.status = msg.status;
+        result.duration = msg.duration;
+        result.timing = msg.timing;
+        result.first.fail_file = msg.first_file, result.first.fail_line = msg.first_line;
+        result.last.fail_file = msg.last_file, result.last.fail_line = msg.last_line;
+    }
+
+    finish_test(runner, w->test, &result, output, msg.out_len);
+    w->test = UINT_MAX;
+
+    /* worker exits after the batch, new one will be forked on demand */
+    if (w->pid && fork_batch && w->count == fork_batch)
+        stop_worker(w);
+}
+
+static void run_isolated(struct runner *runner)
+{
+    unsigned nworkers = jobs < runner->ntests ? jobs : runner->ntests;
+    struct worker *workers = calloc(nworkers + 1, sizeof(*workers));
+    struct pollfd *fds = calloc(nworkers + 1, sizeof(*fds));
+    if (!workers || !fds) abort();
+
+    signal(SIGPIPE, SIG_IGN);
+
+    unsigned ndone = 0;
+    while (ndone < runner->ntests)
+    {
+        /* start new workers in place of terminated ones, pass the tests to idle workers */
+        for (struct worker *w = workers; w != &workers[nworkers]; w++)
+        {
+            if (runner->next == runner->ntests)
+                break;
+
+            if (!w->pid && start_worker(runner, workers, nworkers, w) < 0) {
+                perror("can't start worker process");
+                exit(EXIT_FAILURE);
+            }
+
+            if (w->test == UINT_MAX) {
+                /* if the worker is dead, EOF will be detected on result pipe */
+                w->test = runner->next++;
+                w->count++;
+                w->start = time_ns();
+                double seconds = test_timeout(runner->tests[w->test]);
+                w->deadline = seconds > 0 ? w->start + (unsigned long long)(seconds * 1e9) : 0;
+                w->timed_out = 0;
+                write_all(w->cmd, &w->test, sizeof(w->test));
+            }
+        }
+
+        /* wait for results until the nearest deadline, kill timed out workers */
+        unsigned nfds = 0;
+        int wait_ms = -1;
+        unsigned long long now = time_ns();
+        for (struct worker *w = workers; w != &workers[nworkers]; w++)
+        {
+            if (w->test == UINT_MAX || !w->pid)
+                continue;
+
+            /* timed out worker gets a chance to send the output of the test */
+            if (w->deadline && now >= w->deadline && !w->timed_out) {
+                kill(w->pid, SIGTERM);
+                w->timed_out = 1;
+                w->deadline = now + WORKER_TERM_GRACE * 1000000ULL;
+                wait_ms = 0;
+            }
+            else if (w->deadline && now >= w->deadline) {
+                kill(w->pid, SIGKILL);
+                w->deadline = 0;
+            }
+            else if (w->deadline) {
+                int ms = (w->deadline - now + 999999) / 1000000;
+                if (wait_ms < 0 || ms < wait_ms)
+                    wait_ms = ms;
+            }
+
+            fds[nfds++] = (struct pollfd){.fd = w->res, .events = POLLIN};
+        }
+
+        if (poll(fds, nfds, wait_ms) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        for (unsigned i = 0, n = 0; i < nfds; i++)
+        {
+            if (!fds[i].revents)
+                continue;
+
+            while (workers[n].res != fds[i].fd || !workers[n].pid || workers[n].test == UINT_MAX)
+                ++n;
+
+            receive_result(runner, &workers[n], workers[n].start);
+            ++ndone;
+        }
+    }
+
+    for (struct worker *w = workers; w != &workers[nworkers]; w++)
+        if (w->pid)
+            stop_worker(w);
+
+    signal(SIGPIPE, SIG_DFL);
+    free(workers), free(fds);
+}
+#endif
+
+struct suite_time {
+    const struct _nt_suite *suite;
+    unsigned ntests;
+    unsigned long long wall, cpu;
+};
+
+static int suite_time_cmp(const void *left, const void *right)
+{
+    const struct suite_time *l = (const struct suite_time*)left, *r = (const struct suite_time*)right;
+    return strcmp(l->suite->name, r->suite->name);
+}
+
+static int suite_time_cmp_wall(const void *left, const void *right)
+{
+    const struct suite_time *l = (const struct suite_time*)left, *r = (const struct suite_time*)right;
+    return l->wall < r->wall ? 1 : l->wall > r->wall ? -1 : 0;
+}
+
+static unsigned long long sum_phases(const unsigned long long time[NUM_PHASES])
+{
+    return time[PHASE_SETUP] + time[PHASE_TEST] + time[PHASE_TEARDOWN];
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+    const struct _nt_site *x = *(const struct _nt_site *const *)a;
+    const struct _nt_site *y = *(const struct _nt_site *const *)b;
+    int cmp = strcmp(x->file, y->file);
+    if (cmp || x->line != y->line)
+        return cmp ? cmp : x->line < y->line ? -1 : 1;
+
+    /* sites on the same line are ordered by address, so the order is stable */
+    return x < y ? -1 : x > y;
+}
+
+/* Print number of executions of each assertion (of all tests in the program,
+ * not only of the selected tests), and the assertions never executed. */
+static void print_assert_stats(void)
+{
+    const struct _nt_site *const *start;
+    size_t nsites = all_sites(&start);
+    const struct _nt_site **sites = malloc((nsites + 1) * sizeof(*sites));
+    if (!sites) abort();
+
+    memcpy(sites, start, nsites * sizeof(*sites));
+    qsort(sites, nsites, sizeof(*sites), site_cmp);
+
+    size_t executed = 0;
+    SINK_PRINTF(out, "\nAssertion statistics (executions):\n");
+    for (size_t n = 0; n < nsites; n++)
+    {
+        const struct _nt_site *site = sites[n];
+        unsigned long hits = *site->hits;
+        executed += hits != 0;
+
+        char count[32];
+        snprintf(count, sizeof(count), "%10lu", hits);
+        SINK_PRINTF(out, "%s  %s:%u: %s", hits ? count : "     never", site->file, site->line, site->name);
+        if (site->narg)
+            SINK_PRINTF(out, "(%s)\n", site->left_expr);
+        else
+            SINK_PRINTF(out, "(%s %s %s)\n", site->left_expr, site->op, site->right_expr);
+    }
+
+    SINK_PRINTF(out, "%zu of %zu assertions executed.\n\n", executed, nsites);
+    free(sites);
+}
+
+/* Print list of slowest tests and total time of each suite. */
+static void print_durations(struct runner *runner)
+{
+    struct schedule *tests = malloc((runner->ntests + 1) * sizeof(*tests));
+    struct suite_time *suites = malloc((runner->ntests + 1) * sizeof(*suites));
+    if (!tests || !suites) abort();
+
+    for (unsigned n = 0; n < runner->ntests; n++) {
+        tests[n] = (struct schedule){runner->results[n].duration, n, runner->tests[n]};
+        suites[n] = (struct suite_time){test_suite(runner->tests[n], 0), 1,
+                runner->results[n].duration, sum_phases(runner->results[n].timing.cpu)};
+    }
+
+    qsort(tests, runner->ntests, sizeof(*tests), schedule_cmp);
+
+    unsigned count = durations < runner->ntests ? durations : runner->ntests;
+    SINK_PRINTF(out, "\nSlowest %u tests (wall and CPU time, ms):\n", count);
+    for (unsigned n = 0; n < count; n++)
+    {
+        const struct timing *t = &runner->results[tests[n].order].timing;
+        SINK_PRINTF(out, "%10.3f %10.3f  %s  (setup %.3f/%.3f, test %.3f/%.3f, teardown %.3f/%.3f)\n",
+            tests[n].duration / 1e6, sum_phases(t->cpu) / 1e6, tests[n].test->name,
+            t->wall[PHASE_SETUP] / 1e6, t->cpu[PHASE_SETUP] / 1e6,
+            t->wall[PHASE_TEST] / 1e6, t->cpu[PHASE_TEST] / 1e6,
+            t->wall[PHASE_TEARDOWN] / 1e6, t->cpu[PHASE_TEARDOWN] / 1e6);
+    }
+
+    /* group tests by suites */
+    qsort(suites, runner->ntests, sizeof(*suites), suite_time_cmp);
+    unsigned nsuites = 0;
+    for (unsigned n = 0; n < runner->ntests; n++)
+    {
+        if (nsuites && !suite_time_cmp(&suites[nsuites - 1], &suites[n])) {
+            suites[nsuites - 1].ntests++;
+            suites[nsuites - 1].wall += suites[n].wall;
+            suites[nsuites - 1].cpu += suites[n].cpu;
+        }
+        else
+            suites[nsuites++] = suites[n];
+    }
+
+    qsort(suites, nsuites, sizeof(*suites), suite_time_cmp_wall);
+
+    SINK_PRINTF(out, "\nTotal time of suites (wall and CPU time, ms):\n");
+    for (unsigned n = 0; n < nsuites; n++)
+        SINK_PRINTF(out, "%10.3f %10.3f  %s  (%u tests)\n",
+            suites[n].wall / 1e6, suites[n].cpu / 1e6, suites[n].suite->name, suites[n].ntests);
+
+    SINK_PRINTF(out, "\n");
+    free(tests), free(suites);
+}
+
+static int run_all_tests(const struct filters *filters)
+{
+    size_t count = all_tests.count;
+
+    struct runner runner = {.tests = NULL};
+    runner.tests = malloc((count + 1) * sizeof(*runner.tests));
+    runner.results = calloc(count + 1, sizeof(*runner.results));
+    runner.outputs = calloc(count + 1, sizeof(*runner.outputs));
+    if (!runner.tests || !runner.results || !runner.outputs) abort();
+
+    for (size_t n = 0; n < count; n++)
+        if (select_test(all_tests.tests[n], filters))
+            runner.tests[runner.ntests++] = all_tests.tests[n];
+
+    struct history history = {NULL, 0, 0, 0};
+    if (state_file)
+        history_load(&history, state_file);
+
+    if (shard_count)
+        select_shard(runner.tests, &runner.ntests, &history);
+
+    if (state_file && jobs > 1)
+        schedule_tests(&runner, &history);
+
+    if (failed_first || last_failed)
+        failed_tests_first(runner.tests, &runner.ntests, &history, last_failed);
+
+    int need_watchdog = 0;
+    for (unsigned n = 0; n < runner.ntests; n++)
+        need_watchdog |= test_timeout(runner.tests[n]) > 0;
+
+    report_begin(runner.tests, runner.ntests);
+
+#ifdef __unix__
+    if (isolate)
+        run_isolated(&runner);
+    else {
+        if (need_watchdog && watchdog_start(jobs + 1) < 0)
+            fprintf(stderr, "%s: can't start watchdog, timeouts are disabled\n", argv0);
+
+        if (jobs > 1)
+            run_parallel(&runner);
+    }
+#endif
+
+    /* tests not taken by worker threads (if any) run in current thread */
+    watchdog_attach();
+    for (; runner.next < runner.ntests; runner.next++) {
+        struct result result;
+        run_test(runner.tests[runner.next], NULL, &result);
+        finish_test(&runner, runner.next, &result, NULL, 0);
+    }
+    watchdog_detach();
+    release_test_memory();
+
+#ifdef __unix__
+    watchdog_stop();
+#endif
+
+    /* all shards must read the same durations to agree on the assignment,
+     * so the state file is read only when running a shard */
+    if (state_file && !shard_count) {
+        update_history(&runner, &history);
+        history_save(&history, state_file);
+    }
+    history_free(&history);
+
+    report_end();
+
+    if (durations)
+        print_durations(&runner);
+
+    if (_nt_count_hits)
+        print_assert_stats();
+
+    free(runner.tests), free(runner.results), free(runner.outputs);
+
+    unsigned ntests = runner.ntests, nfails = runner.nfails;
+    SINK_PRINTF(out, "%u/%u tests passed, %u tests failed.\n", ntests - nfails, ntests, nfails);
+    sink_flush(out);
+    return nfails != 0;
+}
+
+
+/* Benchmarks: the number of iterations is calibrated, so one repetition takes
+ * at least `bench_time` seconds, then the benchmark is repeated `bench_reps`
+ * times with the same number of iterations. */
+
+enum { BENCH_MAX_ITERATIONS = 1000000000 };
+
+unsigned long long _nt_bench_begin(void)
+{
+    struct bench *bench = tls_context ? tls_context->bench : NULL;
+    if (!bench)
+        return 1;   /* BENCHMARK_LOOP used outside of benchmark */
+
+    bench->start = time_ns();
+    return bench->iterations;
+}
+
+void _nt_bench_end(void)
+{
+    struct bench *bench = tls_context ? tls_context->bench : NULL;
+    if (bench)
+        bench->stop = time_ns();
+}
+
+/* Run given number of iterations, returns elapsed time in nanoseconds. */
+static unsigned long long bench_measure(struct context *ctx, struct bench *bench,
+                                        unsigned long long iterations)
+{
+    bench->iterations = iterations;
+    bench->start = bench->stop = 0;
+
+    unsigned long long start = time_ns();
+    ctx->test->func(ctx->fixture);
+    if (bench->start)
+        return bench->stop - bench->start;
+
+    /* benchmark without BENCHMARK_LOOP, each call is one iteration */
+    for (unsigned long long n = 1; n < iterations; n++)
+        ctx->test->func(ctx->fixture);
+
+    return time_ns() - start;
+}
+
+static void bench_run(struct context *ctx, struct bench *bench)
+{
+    unsigned long long target = bench_time * 1e9, iterations = 1, elapsed;
+
+    /* increase number of iterations until the time of the repetition exceeds
+     * target time, precise estimation is made only if the time is not too short */
+    while ((elapsed = bench_measure(ctx, bench, iterations)) < target
+            && iterations < BENCH_MAX_ITERATIONS)
+    {
+        double scale = elapsed > target / 10 ? 1.4 * target / elapsed : 10;
+        unsigned long long next = iterations * scale;
+        iterations = next > iterations ? next : iterations + 1;
+        if (iterations > BENCH_MAX_ITERATIONS)
+            iterations = BENCH_MAX_ITERATIONS;
+    }
+
+    for (unsigned n = 0; n < bench->reps; n++)
+        bench->samples[n] = (double)bench_measure(ctx, bench, iterations) / iterations;
+
+    bench->iterations = iterations;
+}
+
+static int double_cmp(const void *left, const void *right)
+{
+    double l = *(const double*)left, r = *(const double*)right;
+    return l < r ? -1 : l > r;
+}
+
+/* Newton's method, so the runner doesn't need to be linked with libm. */
+static double square_root(double x)
+{
+    double r = x > 1 ? x : 1;
+    for (unsigned n = 0; x > 0 && n < 64; n++)
+        r = (r + x / r) / 2;
+
+    return x > 0 ? r : 0;
+}
+
+static void print_bench(const struct _nt_test *test, struct bench *bench)
+{
+    double *s = bench->samples;
+    unsigned reps = bench->reps;
+    qsort(s, reps, sizeof(*s), double_cmp);
+
+    double mean = 0, var = 0;
+    for (unsigned n = 0; n < reps; n++)
+        mean += s[n] / reps;
+
+    for (unsigned n = 0; n < reps; n++)
+        var += (s[n] - mean) * (s[n] - mean) / (reps > 1 ? reps - 1 : 1);
+
+    double median = reps % 2 ? s[reps / 2] : (s[reps / 2 - 1] + s[reps / 2]) / 2;
+
+    SINK_PRINTF(out, "%s: %llu iterations x %u, ns/iter: min %.3f, median %.3f, mean %.3f, stddev %.3f\n",
+        test->name, bench->iterations, reps, s[0], median, mean, square_root(var));
+    sink_flush(out);
+}
+
+static int run_benchmarks(const struct filters *filters)
+{
+    int need_watchdog = 0;
+    for (size_t n = 0; n < all_benchmarks.count; n++)
+        need_watchdog |= select_test(all_benchmarks.tests[n], filters)
+                            && test_timeout(all_benchmarks.tests[n]) > 0;
+
+#ifdef __unix__
+    if (need_watchdog && watchdog_start(1) < 0)
+        fprintf(stderr, "%s: can't start watchdog, timeouts are disabled\n", argv0);
+#endif
+
+    double *samples = malloc(bench_reps * sizeof(*samples));
+    if (!samples) abort();
+
+    /* benchmarks always run sequentially, so they don't disturb each other */
+    unsigned count = 0, nfails = 0;
+    watchdog_attach();
+    for (size_t n = 0; n < all_benchmarks.count; n++)
+    {
+        const struct _nt_test *test = all_benchmarks.tests[n];
+        if (!select_test(test, filters))
+            continue;
+
+        struct bench bench = {0, 0, 0, bench_reps, samples};
+        struct result result;
+        run_test(test, &bench, &result);
+
+        if (result.status == TEST_PASSED)
+            print_bench(test, &bench);
+
+        nfails += result.status == TEST_FAILED || result.status == TEST_TIMEOUT;
+        result_free(&result);
+        ++count;
+    }
+    watchdog_detach();
+    release_test_memory();
+
+#ifdef __unix__
+    watchdog_stop();
+#endif
+
+    free(samples);
+
+    SINK_PRINTF(out, "%u/%u benchmarks passed, %u benchmarks failed.\n", count - nfails, count, nfails);
+    sink_flush(out);
+    return nfails != 0;
+}
+
+
+/* Repeated run of the tests (--repeat, --until-fail, --stress-threads): each
+ * iteration runs all selected tests in the same process, and with
+ * --stress-threads each test runs simultaneously in several threads, each
+ * thread has its own fixture and context of the test. Output of the test
+ * is printed only if it fails (or with --verbose option). */
+
+struct stress;
+
+struct stress_slot {
+    struct stress *stress;
+#ifdef __unix__
+    pthread_t thread;
+#endif
+    struct sink sink;
+    struct result result;
+};
+
+struct stress {
+    const struct _nt_test *test;    /* test to run, NULL stops the threads */
+    unsigned nthreads;
+    struct stress_slot *slots;      /* first slot is used by main thread */
+#ifdef __unix__
+    pthread_barrier_t start, done;
+#endif
+};
+
+/* Runs, failures and time of each test. */
+struct repeat_stat {
+    unsigned long runs, fails;
+    unsigned long first_fail;       /* iteration of first failure (from 1), or 0 */
+    unsigned long long duration;
+};
+
+#ifdef __unix__
+static void* stress_thread(void *arg)
+{
+    struct stress_slot *slot = (struct stress_slot*)arg;
+    struct stress *stress = slot->stress;
+    out = &slot->sink;
+
+    alt_stack_init();
+    watchdog_attach();
+
+    while (pthread_barrier_wait(&stress->start), stress->test) {
+        run_test(stress->test, NULL, &slot->result);
+        pthread_barrier_wait(&stress->done);
+    }
+
+    watchdog_detach();
+    release_test_memory();
+    alt_stack_free();
+
+    out = NULL;
+    return NULL;
+}
+#endif
+
+/* Run the test in all threads at once. */
+static void stress_test(struct stress *thiz, const struct _nt_test *test)
+{
+    thiz->test = test;
+#ifdef __unix__
+    if (thiz->nthreads > 1)
+        pthread_barrier_wait(&thiz->start);
+#endif
+
+    struct sink *text = out;
+    out = &thiz->slots[0].sink;
+    run_test(test, NULL, &thiz->slots[0].result);
+    out = text;
+
+#ifdef __unix__
+    if (thiz->nthreads > 1)
+        pthread_barrier_wait(&thiz->done);
+#endif
+}
+
+static void stress_start(struct stress *thiz, unsigned nthreads)
+{
+    thiz->test = NULL;
+    thiz->nthreads = nthreads;
+    thiz->slots = (struct stress_slot*)calloc(nthreads, sizeof(*thiz->slots));
+    if (!thiz->slots) abort();
+
+    for (unsigned n = 0; n < nthreads; n++)
+        thiz->slots[n].stress = thiz, thiz->slots[n].sink.fd = -1;
+
+#ifdef __unix__
+    if (nthreads == 1)
+        return;
+
+    pthread_barrier_init(&thiz->start, NULL, nthreads);
+    pthread_barrier_init(&thiz->done, NULL, nthreads);
+    for (unsigned n = 1; n < nthreads; n++) {
+        if (pthread_create(&thiz->slots[n].thread, NULL, stress_thread, &thiz->slots[n])) {
+            perror("can't create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+}
+
+static void stress_stop(struct stress *thiz)
+{
+#ifdef __unix__
+    if (thiz->nthreads > 1) {
+        thiz->test = NULL;
+        pthread_barrier_wait(&thiz->start);
+        for (unsigned n = 1; n < thiz->nthreads; n++)
+            pthread_join(thiz->slots[n].thread, NULL);
+
+        pthread_barrier_destroy(&thiz->start);
+        pthread_barrier_destroy(&thiz->done);
+    }
+#endif
+
+    for (unsigned n = 0; n < thiz->nthreads; n++)
+        sink_free(&thiz->slots[n].sink);
+
+    free(thiz->slots);
+}
+
+static int run_repeated(const struct filters *filters)
+{
+    const struct _nt_test **tests = malloc((all_tests.count + 1) * sizeof(*tests));
+    struct repeat_stat *stats = calloc(all_tests.count + 1, sizeof(*stats));
+    if (!tests || !stats) abort();
+
+    unsigned ntests = 0;
+    int need_watchdog = 0;
+    for (size_t n = 0; n < all_tests.count; n++) {
+        if (select_test(all_tests.tests[n], filters)) {
+            tests[ntests++] = all_tests.tests[n];
+            need_watchdog |= test_timeout(all_tests.tests[n]) > 0;
+        }
+    }
+
+#ifdef __unix__
+    if (need_watchdog && watchdog_start(stress_threads) < 0)
+        fprintf(stderr, "%s: can't start watchdog, timeouts are disabled\n", argv0);
+#endif
+
+    struct stress stress;
+    stress_start(&stress, stress_threads);
+    watchdog_attach();
+
+    /* without --repeat the tests are repeated until failure, or run once */
+    unsigned long iterations = repeat ? repeat : until_fail ? ULONG_MAX : 1, iteration = 0;
+    unsigned nfails = 0;
+    unsigned long long start = time_ns();
+    while (iteration < iterations && !(until_fail && nfails))
+    {
+        ++iteration;
+        for (unsigned n = 0; n < ntests && !(until_fail && nfails); n++)
+        {
+            unsigned long long test_start = time_ns();
+            stress_test(&stress, tests[n]);
+            stats[n].duration += time_ns() - test_start;
+            stats[n].runs++;
 
-    struct msg_collect col = {.cons.func = msg_collect, .text = strdup(msg->buf.str)};
-    scope_msg_get(current_test->scope_msg, &col.cons);
+            int failed = 0;
+            for (unsigned k = 0; k < stress.nthreads; k++)
+            {
+                struct stress_slot *slot = &stress.slots[k];
+                enum status status = slot->result.status;
+                int fail = status == TEST_FAILED || status == TEST_CRASHED || status == TEST_TIMEOUT;
+                if (fail || verbose) {
+                    if (stress.nthreads > 1)
+                        SINK_PRINTF(out, "Iteration %lu, thread %u:\n", iteration, k);
+                    else
+                        SINK_PRINTF(out, "Iteration %lu:\n", iteration);
+                    sink_write(out, slot->sink.buf, slot->sink.len);
+                }
+
+                failed |= fail;
+                slot->sink.len = 0;
+                result_free(&slot->result);
+            }
 
-    if (!current_test->first.fail_line) {
-        fprintf(out, "Test %s FAILED:\n", current_test->name);
-        current_test->first.fail_file = file;
-        current_test->first.fail_line = line;
-        free(current_test->first.fail_msg);
-        current_test->first.fail_msg = strdup(col.text);
+            if (failed) {
+                nfails += !stats[n].fails++;
+                if (!stats[n].first_fail)
+                    stats[n].first_fail = iteration;
+            }
+
+            sink_flush(out);
+        }
     }
 
-    fprintf(out, "%s: %u: failure with a message: %s\n", file, line, col.text);
-    fflush(out);
+    double elapsed = (time_ns() - start) / 1e9;
+
+    watchdog_detach();
+    stress_stop(&stress);
+    release_test_memory();
 
-    free(col.text);
+#ifdef __unix__
+    watchdog_stop();
+#endif
+
+    SINK_PRINTF(out, "\n%lu iterations in %.3f seconds (%.1f iterations/sec)",
+        iteration, elapsed, elapsed > 0 ? iteration / elapsed : 0.0);
+    if (stress.nthreads > 1)
+        SINK_PRINTF(out, ", %u threads", stress.nthreads);
+    SINK_PRINTF(out, ":\n");
+
+    for (unsigned n = 0; n < ntests; n++)
+    {
+        const struct repeat_stat *stat = &stats[n];
+        double seconds = stat->duration / 1e9;
+        SINK_PRINTF(out, "%10.1f/sec  %s: %lu runs", seconds > 0 ? stat->runs / seconds : 0.0,
+            tests[n]->name, stat->runs);
+        if (stat->fails)
+            SINK_PRINTF(out, ", %lu failed, first at iteration %lu", stat->fails, stat->first_fail);
+        SINK_PRINTF(out, "\n");
+    }
 
-    longjmp(*(jmp_buf*)current_test->jmpbuf, 1);
+    SINK_PRINTF(out, "\n%u/%u tests passed, %u tests failed.\n", ntests - nfails, ntests, nfails);
+    sink_flush(out);
+
+    free(tests), free(stats);
+    return nfails != 0;
 }
 
-void _nt_fail_check(const char *file, unsigned line, unsigned nargs, ...)
+
+/* List the tests matching the filters (with the shard of each test, if
+ * --shard option is given), all suites and benchmarks. */
+static int list_tests(const struct filters *filters)
 {
-    va_list args;
-    va_start(args, nargs);
+    /* suites of the tests found in the section aren't known until now */
+    for (size_t n = 0; n < all_tests.count; n++)
+        test_suite(all_tests.tests[n], 1);
 
-    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
-    _NT_PRINTF(msg, "%s:%u: ", file, line);
-    _nt_message(msg, nargs, args);
+    for (size_t n = 0; n < all_benchmarks.count; n++)
+        test_suite(all_benchmarks.tests[n], 1);
+
+    puts("Suites:");
+    struct _nt_suite *suite = suites_list;
+    while (suite) {
+        printf("\t%s\n", suite->name);
+        suite = suite->next;
+    }
+    puts("");
+
+    const struct _nt_test **tests = malloc((all_tests.count + 1) * sizeof(*tests));
+    unsigned *shards = malloc((all_tests.count + 1) * sizeof(*shards));
+    if (!tests || !shards) abort();
+
+    unsigned ntests = 0;
+    for (size_t n = 0; n < all_tests.count; n++)
+        if (select_test(all_tests.tests[n], filters))
+            tests[ntests++] = all_tests.tests[n];
 
-    struct msg_collect col = {.cons.func = msg_collect, .text = strdup(msg->buf.str)};
-    scope_msg_get(current_test->scope_msg, &col.cons);
+    if (shard_count) {
+        struct history history = {NULL, 0, 0, 0};
+        if (state_file)
+            history_load(&history, state_file);
 
-    scope_msg_reset(current_test->scope_msg);
+        assign_shards(tests, ntests, &history, shards);
+        history_free(&history);
+    }
+
+    puts("Tests:");
+    for (unsigned n = 0; n < ntests; n++)
+        if (shard_count)
+            printf("\t%s %s\tshard %u\n", tests[n]->suite->name, tests[n]->name, shards[n]);
+        else
+            printf("\t%s %s\n", tests[n]->suite->name, tests[n]->name);
+    puts("");
+
+    free(tests), free(shards);
+
+    /* the header is printed only if some benchmarks are selected */
+    int header = 0;
+    for (size_t n = 0; n < all_benchmarks.count; n++)
+    {
+        const struct _nt_test *test = all_benchmarks.tests[n];
+        if (!select_test(test, filters))
+            continue;
 
-    if (!current_test->first.fail_line) {
-        fprintf(out, "Test %s FAILED:\n", current_test->name);
-        current_test->first.fail_file = file;
-        current_test->first.fail_line = line;
-        free(current_test->first.fail_msg);
-        current_test->first.fail_msg = strdup(col.text);
+        if (!header++)
+            puts("Benchmarks:");
+
+        printf("\t%s %s\n", test->suite->name, test->name);
     }
 
-    fprintf(out, "%s: %u: failure with a message: %s\n", file, line, col.text);
-    fflush(out);
+    if (header)
+        puts("");
 
-    free(col.text);
-    va_end(args);
+    return EXIT_SUCCESS;
 }
 
-void _nt_skip(const char *file, unsigned line, unsigned nargs, ...)
-{
-    va_list args;
-    va_start(args, nargs);
-    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
-    _NT_PRINTF(msg, "%s:%u: ", file, line);
-    _nt_message(msg, nargs, args);
-    fprintf(out, "Test %s is skipped at %s:%u: %s\n", current_test->name, file, line, msg->buf.str);
-    fflush(out);
-    longjmp(*(jmp_buf*)current_test->jmpbuf, 1);
-}
 
-void _nt_success(const char *file, unsigned line, unsigned nargs, ...)
+/* Parse numeric argument of the command line option. */
+static unsigned long opt_number(int argc, const char *const* argv)
 {
-    va_list args;
-    va_start(args, nargs);
-    if (nargs) {
-        _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
-        _NT_PRINTF(msg, "%s:%u: ", file, line);
-        _nt_message(msg, nargs, args);
-        fprintf(out, "%s\n", msg->buf.str);
-        fflush(out);
+    char *end = NULL;
+    unsigned long val = argc > 0 ? strtoul(argv[0], &end, 10) : 0;
+    if (argc < 1 || !*argv[0] || *end) {
+        fprintf(stderr, "%s: '%s': number expected\n", argv0, argc > 0 ? argv[0] : "");
+        exit(EXIT_FAILURE);
     }
-    assert(current_test);
-    longjmp(*(jmp_buf*)current_test->jmpbuf, 1);
+    return val;
 }
 
-void _nt_warn(const char *file, unsigned line, unsigned nargs, ...)
+static int cmd_list(int argc, const char *const* argv)
 {
-    va_list args;
-    va_start(args, nargs);
-    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
-    _NT_PRINTF(msg, "%s:%u: ", file, line);
-    _nt_message(msg, nargs, args);
-    fprintf(out, "WARN: %s\n", msg->buf.str);
-    fflush(out);
-    va_end(args);
+    (void)argc, (void)argv;
+    list = 1;
+    return 0;
 }
 
-void _nt_info(_nt_uniq_t ident, const char *file, unsigned line, unsigned nargs, ...)
+static int cmd_verbose(int argc, const char *const* argv)
 {
-    va_list args;
-    va_start(args, nargs);
+    (void)argc, (void)argv;
+    
+    verbose = 1;
 
-    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
-    _NT_PRINTF(msg, "%s:%u: ", file, line);
-    _nt_message(msg, nargs, args);
+    return 0;
+}
 
-    assert(current_test);
-    scope_msg_add(current_test->scope_msg, ident, msg->buf.str);
-    
-    va_end(args);
+
+static int cmd_jobs(int argc, const char *const* argv)
+{
+    jobs = opt_number(argc, argv);
+#ifdef __unix__
+    if (!jobs) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = ncpu > 0 ? ncpu : 1;
+    }
+#endif
+    if (!jobs)
+        jobs = 1;
+
+    return 1;
 }
 
-void _nt_capture(_nt_uniq_t ident, const char *file, unsigned line, unsigned nargs, ...)
+
+static int cmd_isolate(int argc, const char *const* argv)
 {
-    if (!nargs)
-        return;
+    (void)argc, (void)argv;
 
-    _nt_print_t msg = (_nt_print_t)MAKE_STRING_BUF(10 * LINE_MAX);
-    _NT_PRINTF(msg, "%s:%u: ", file, line);
+    isolate = 1;
 
-    va_list args;
-    va_start(args, nargs);
+    return 0;
+}
 
-    const char *dlm = "";
-    for (unsigned n = 0; n < nargs; n++)
-    {
-        const char *name = va_arg(args, const char*);
-        const _nt_value_t *val = va_arg(args, _nt_value_t*);
-        _nt_typeinfo_t type = va_arg(args, _nt_typeinfo_t);
 
-        if (!is_literal(name))
-            _NT_PRINTF(msg, "%s%s = ", dlm, name);
-        else
-            _NT_PRINTF(msg, "%s", dlm);
+static int cmd_fork(int argc, const char *const* argv)
+{
+    isolate = 1;
+    fork_batch = argc ? opt_number(argc, argv) : 1;
+    if (!fork_batch)
+        fork_batch = 1;
 
-        type->print(msg, val);
-        dlm = ", ";
+    return 0;
+}
+
+
+static int cmd_state(int argc, const char *const* argv)
+{
+    if (argc < 1) {
+        fprintf(stderr, "%s: file name expected\n", argv0);
+        exit(EXIT_FAILURE);
     }
 
-    va_end(args);
+    state_file = argv[0];
+    return 1;
+}
+
 
-    assert(current_test);
-    scope_msg_add(current_test->scope_msg, ident, msg->buf.str);
+static int cmd_durations(int argc, const char *const* argv)
+{
+    durations = opt_number(argc, argv);
+    return 1;
 }
 
-void _nt_scope_reset(void)
+
+static int cmd_timeout(int argc, const char *const* argv)
 {
-    scope_msg_reset(current_test->scope_msg);
+    char *end = NULL;
+    timeout = argc > 0 ? strtod(argv[0], &end) : 0;
+    if (argc < 1 || !*argv[0] || *end || timeout < 0) {
+        fprintf(stderr, "%s: '%s': time in seconds expected\n", argv0, argc > 0 ? argv[0] : "");
+        exit(EXIT_FAILURE);
+    }
+
+    return 1;
 }
 
 
+static int cmd_bench(int argc, const char *const* argv)
+{
+    (void)argc, (void)argv;
+
+    bench = 1;
+
+    return 0;
+}
+
 
-static int run_all_tests(int nfilt, const char *const* filters)
+static int cmd_bench_reps(int argc, const char *const* argv)
 {
-    unsigned ntests = 0, nfails = 0;
-    struct _nt_test *test = tests_list;
-    while (test)
-    {
-        char const *const* filt = filters;
-        while (filt != &filters[nfilt]) {
-            if (match(test->name, *filt))
-                break;
+    bench_reps = opt_number(argc, argv);
+    if (!bench_reps)
+        bench_reps = 1;
 
-            ++filt;
-        }
+    return 1;
+}
 
-        if (!nfilt || filt != &filters[nfilt])
-        {
-            ++ntests;
-            if (run_test(test))
-                ++nfails;
-        }
 
-        test = test->next;
+static int cmd_bench_time(int argc, const char *const* argv)
+{
+    char *end = NULL;
+    bench_time = argc > 0 ? strtod(argv[0], &end) : 0;
+    if (argc < 1 || !*argv[0] || *end || bench_time < 0) {
+        fprintf(stderr, "%s: '%s': time in seconds expected\n", argv0, argc > 0 ? argv[0] : "");
+        exit(EXIT_FAILURE);
     }
 
-    fprintf(out, "%u/%u tests passed, %u tests failed.\n", ntests - nfails, ntests, nfails);
-    fflush(out);
-    return ntests != nfails;
+    return 1;
 }
 
 
-static int cmd_list(int argc, const char *const* argv)
+static int cmd_reporter(int argc, const char *const* argv)
 {
-    (void)argc, (void)argv;
+    for (unsigned n = 0; argc > 0 && n < Size(reporters); n++)
+        if (!strcmp(argv[0], reporters[n].name))
+            reporter = &reporters[n];
 
-    puts("Suites:");
-    struct _nt_suite *suite = suites_list;
-    while (suite) {
-        printf("\t%s\n", suite->name);
-        suite = suite->next;
+    if (!reporter) {
+        fprintf(stderr, "%s: '%s': unknown reporter\n", argv0, argc > 0 ? argv[0] : "");
+        exit(EXIT_FAILURE);
     }
-    puts("");
 
-    puts("Tests:");
-    struct _nt_test *test = tests_list;
-    while (test) {
-        printf("\t%s %s\n", test->suite->name, test->name);
-        test = test->next;
-    }
-    puts("");
+    return 1;
+}
 
-    exit(EXIT_SUCCESS);
+static int cmd_failed_first(int argc, const char *const* argv)
+{
+    (void)argc, (void)argv;
+    failed_first = 1;
     return 0;
 }
 
-static int cmd_verbose(int argc, const char *const* argv)
+static int cmd_last_failed(int argc, const char *const* argv)
 {
     (void)argc, (void)argv;
-    
-    verbose = 0;
+    last_failed = 1;
+    return 0;
+}
+
+#ifdef __unix__
+static int cmd_catch_crashes(int argc, const char *const* argv)
+{
+    (void)argc, (void)argv;
+    catch_crashes = 1;
+    return 0;
+}
+#endif
 
+static int cmd_repeat(int argc, const char *const* argv)
+{
+    repeat = opt_number(argc, argv);
+    return 1;
+}
+
+static int cmd_until_fail(int argc, const char *const* argv)
+{
+    (void)argc, (void)argv;
+    until_fail = 1;
+    return 0;
+}
+
+#ifdef __unix__
+static int cmd_stress_threads(int argc, const char *const* argv)
+{
+    stress_threads = opt_number(argc, argv);
+    if (!stress_threads)
+        stress_threads = 1;
+
+    return 1;
+}
+#endif
+
+static int cmd_assert_stats(int argc, const char *const* argv)
+{
+    (void)argc, (void)argv;
+    _nt_count_hits = 1;
     return 0;
 }
 
+static int cmd_shard(int argc, const char *const* argv)
+{
+    char *end = NULL;
+    shard_index = argc > 0 ? strtoul(argv[0], &end, 10) : 0;
+    if (end && *end == '/' && end != argv[0])
+        shard_count = strtoul(end + 1, &end, 10);
+
+    if (argc < 1 || *end || shard_index >= shard_count) {
+        fprintf(stderr, "%s: '%s': INDEX/COUNT expected (0 <= INDEX < COUNT)\n",
+            argv0, argc > 0 ? argv[0] : "");
+        exit(EXIT_FAILURE);
+    }
+
+    return 1;
+}
+
+static int cmd_read_log(int argc, const char *const* argv)
+{
+    if (argc < 1) {
+        fprintf(stderr, "%s: file name expected\n", argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    log_files = (const char**)realloc(log_files, (nlog_files + 1) * sizeof(*log_files));
+    if (!log_files) abort();
+
+    log_files[nlog_files++] = argv[0];
+    return 1;
+}
+
+static int cmd_out(int argc, const char *const* argv)
+{
+    if (argc < 1) {
+        fprintf(stderr, "%s: file name expected\n", argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    report_file = argv[0];
+    return 1;
+}
+
+/* Read test filters from the file, one filter per line,
+ * empty lines and lines starting with '#' are ignored. */
+static int cmd_filter_file(int argc, const char *const* argv)
+{
+    if (argc < 1) {
+        fprintf(stderr, "%s: file name expected\n", argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *f = fopen(argv[0], "r");
+    if (!f) {
+        perror(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[LINE_MAX];
+    while (fgets(line, sizeof(line), f))
+    {
+        char *str = line, *end = line + strlen(line);
+        while (isspace((unsigned char)*str))
+            ++str;
+
+        while (end != str && isspace((unsigned char)end[-1]))
+            *--end = 0;
+
+        if (*str && *str != '#')
+            filters_add(&filters, str);
+    }
+
+    fclose(f);
+    return 1;
+}
+
 
 static int cmd_help(int argc, const char *const* argv);
 
+/* Options which have non-empty `args` consume the argument: it might be
+ * given as next argument ("-j 4", "--jobs 4"), or might be attached to the
+ * option itself ("-j4", "--jobs=4"). Optional argument (in square brackets)
+ * might be only attached to the option, otherwise handler gets argc == 0. */
 struct cmdline_opt {
     int (*handler)(int argc, const char *const* argv);
     const char *const name[4];
@@ -978,7 +4783,32 @@ struct cmdline_opt {
 static const struct cmdline_opt cmdline_opts[] = {
     {cmd_help,      {"-h", "-help", "--help"},      "",     "print help"},
     {cmd_list,      {"-l", "-list", "--list"},      "",     "list available tests"},
-    {cmd_verbose,   {"-v", "-verbose", "--verbose"}, "",    "print name of each executed test"}
+    {cmd_verbose,   {"-v", "-verbose", "--verbose"}, "",    "print name of each executed test"},
+    {cmd_jobs,      {"-j", "-jobs", "--jobs"},      "N",    "run tests in N parallel threads (0 -- one per CPU)"},
+#ifdef __unix__
+    {cmd_isolate,   {"-i", "-isolate", "--isolate"}, "",    "run tests in separate worker processes"},
+    {cmd_fork,      {"-fork", "--fork"},            "[=N]", "fork new worker for each N tests (default 1)"},
+    {cmd_catch_crashes, {"-catch-crashes", "--catch-crashes"}, "", "report crash of the test as failure and continue"},
+#endif
+    {cmd_state,     {"-state", "--state"},          "FILE", "keep history of test runs in the file"},
+    {cmd_durations, {"-durations", "--durations"},  "N",    "report N slowest tests and time of each suite"},
+    {cmd_timeout,   {"-t", "-timeout", "--timeout"}, "SEC", "abort tests running longer than SEC seconds"},
+    {cmd_filter_file, {"-filter-file", "--filter-file"}, "FILE", "read test filters from the file"},
+    {cmd_reporter,  {"-reporter", "--reporter"},    "NAME", "write report of the run (junit, jsonl, binary)"},
+    {cmd_out,       {"-o", "-out", "--out"},        "FILE", "write the report to the file (default stdout)"},
+    {cmd_read_log,  {"-read-log", "--read-log"},    "FILE", "print (or report) results from binary log"},
+    {cmd_failed_first, {"-ff", "--ff", "-failed-first", "--failed-first"}, "", "run tests failed in previous run first"},
+    {cmd_last_failed, {"-lf", "--lf", "-last-failed", "--last-failed"}, "", "run only tests failed in previous run"},
+    {cmd_shard,     {"-shard", "--shard"},          "I/N",  "run I-th of N shards of the tests (0 <= I < N)"},
+    {cmd_assert_stats, {"-assert-stats", "--assert-stats"}, "", "count executions of each assertion"},
+    {cmd_repeat,    {"-repeat", "--repeat"},        "N",    "repeat the tests N times in the same process"},
+    {cmd_until_fail, {"-until-fail", "--until-fail"}, "",   "repeat the tests until some test fails"},
+#ifdef __unix__
+    {cmd_stress_threads, {"-stress-threads", "--stress-threads"}, "N", "run each test in N threads at once"},
+#endif
+    {cmd_bench,     {"-b", "-bench", "--bench"},    "",     "run benchmarks in place of the tests"},
+    {cmd_bench_reps, {"-bench-reps", "--bench-reps"}, "N",  "repeat each benchmark N times (default 10)"},
+    {cmd_bench_time, {"-bench-time", "--bench-time"}, "SEC", "minimal time of each repetition (default 0.05)"},
 };
 
     
@@ -986,7 +4816,7 @@ static int cmd_help(int argc, const char *const* argv)
 {
     (void)argc, (void)argv;
 
-    printf("%s [-options] [tests-filter...]\n", argv0);
+    printf("%s [-options] [tests-filter...] [-excluded-tests-filter...]\n", argv0);
     puts("Available options are:");
     const struct cmdline_opt *opts = cmdline_opts;
     while (opts != &cmdline_opts[Size(cmdline_opts)]) {
@@ -999,35 +4829,16 @@ static int cmd_help(int argc, const char *const* argv)
 }
 
 
-static int argv_sort(const void *Left, const void *Right)
+/* Find option `arg` in list of options, if option has attached
+ * argument, pointer to it will be stored in `value`. */
+static const struct cmdline_opt* find_option(const char *arg, const char **value)
 {
-    const char *const* left = (const char*const*)Left, 
-               *const *right = (const char *const*)Right;
-    
-    int res = ((*left[0] - '-') & 0xff) - ((*right[0] - '-') & 0xff);
-    return res ? res : strcmp(*left, *right);
-}
-
-int main(int argc, const char *argv[])
-{
-    argv0 = argv[0];
-    out = stdout;
-
-    /* parse command line options */
-    qsort(&argv[1], argc-1, sizeof(char*), argv_sort);
-
-    const char *const* arg = &argv[1];
-    while (arg != &argv[argc])
+    /* exact names are matched first, then "--name=value" form, and only then
+     * short option with attached value, so "-jobs" is not taken for "-j"
+     * with value "obs" */
+    *value = NULL;
+    for (int pass = 0; pass < 3; pass++)
     {
-        if (**arg != '-')
-            break;
-
-        if (!strcmp(*arg, "--")) {
-            ++arg;
-            break;
-        }
-
-        int unknown = 1;
         const struct cmdline_opt *opts = cmdline_opts;
         while (opts != &cmdline_opts[Size(cmdline_opts)])
         {
@@ -1036,26 +4847,93 @@ int main(int argc, const char *argv[])
                 if (!opts->name[i])
                     break;
 
-                if (!strcmp(*arg, opts->name[i]))
-                {
-                    arg += opts->handler(&argv[argc] - arg, &argv[arg - &argv[0] + 1]);
-                    unknown = 0;
-                    break;
+                size_t len = strlen(opts->name[i]);
+                if (strncmp(arg, opts->name[i], len))
+                    continue;
+
+                if (pass == 0 && !arg[len])
+                    return opts;
+
+                if (!*opts->args)
+                    continue;
+
+                if ((pass == 1 && arg[len] == '=') || (pass == 2 && len == 2 && arg[1] != '-')) {
+                    *value = &arg[len + (arg[len] == '=')];
+                    return opts;
                 }
             }
 
             ++opts;
         }
+    }
+
+    return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+    argv0 = argv[0];
+    text_sink.fd = fileno(stdout), text_sink.file = stdout;
+    out = &text_sink;
+
+    register_section_suites();
+    collect_tests(&all_tests, tests_list, SECTION_START(test_), SECTION_STOP(test_));
+    collect_tests(&all_benchmarks, benchmarks_list, SECTION_START(bench_), SECTION_STOP(bench_));
+
+    /* parse command line options, all other arguments are test filters,
+     * argument starting with single '-' and containing '*' or '/' is the
+     * excluding filter (all arguments after "--" are filters) */
+    const char *const* arg = &argv[1];
+    while (arg != &argv[argc])
+    {
+        if (**arg != '-' || ((*arg)[1] != '-' && strpbrk(*arg, "*/") && !strchr(*arg, '='))) {
+            filters_add(&filters, *arg++);
+            continue;
+        }
+
+        if (!strcmp(*arg, "--")) {
+            while (++arg != &argv[argc])
+                filters_add(&filters, *arg);
+            break;
+        }
 
-        if (unknown)
+        const char *value;
+        const struct cmdline_opt *opt = find_option(*arg, &value);
+        if (!opt)
         {
             fprintf(stderr, "%s: '%s': unknown option\n", argv0, *arg);
             exit(EXIT_FAILURE);
         }
 
+        if (value)
+            opt->handler(1, &value);
+        else if (*opt->args == '[')
+            opt->handler(0, arg + 1);
+        else
+            arg += opt->handler(&argv[argc] - arg - 1, arg + 1);
+
         ++arg;
     }
 
-    return run_all_tests(&argv[argc] - arg, arg);
+#ifdef __unix__
+    catch_fatal_signals();
+#endif
+
+    if ((failed_first || last_failed) && !state_file) {
+        fprintf(stderr, "%s: --failed-first and --last-failed require --state option\n", argv0);
+        exit(EXIT_FAILURE);
+    }
+
+    int result = list ? list_tests(&filters) : nlog_files ? read_logs()
+                : bench ? run_benchmarks(&filters)
+                : repeat || until_fail || stress_threads > 1 ? run_repeated(&filters)
+                : run_all_tests(&filters);
+    filters_free(&filters);
+    free(log_files);
+    sink_free(&text_sink);
+#ifdef __unix__
+    alt_stack_free();
+#endif
+    return result;
 }
 
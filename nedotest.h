@@ -23,8 +23,58 @@
  *
  * Suite name and test name must be valid C identifiers (i.e. start from
  * letter or underscore, and consist of letters, underscores and digits).
+ *
+ * Optional attributes of the test might be given after the test name
+ * in form of designated initializers, for example:
+ *
+ * TEST(suite1, func2, .timeout = 30)
+ * {
+ *    ...
+ * }
+ *
+ * Following attributes are supported:
+ *
+ *    .timeout -- maximal time (in seconds) of the test execution, overrides
+ *                the time given in --timeout command line option.
  */
-#define TEST(suite, name)       _NT_TEST(suite, name)
+#define TEST(suite, ...)        _NT_TEST(suite, __VA_ARGS__)
+
+/* Define microbenchmark, example:
+ *
+ * BENCHMARK(suite1, copy_4k)
+ * {
+ *    char src[4096] = {0}, dst[4096];
+ *    BENCHMARK_LOOP {
+ *        memcpy(dst, src, sizeof(dst));
+ *        CLOBBER_MEMORY();
+ *    }
+ * }
+ *
+ * Benchmarks run only when --bench command line option is given, in place
+ * of the tests (same filters are applied to the names of benchmarks).
+ * Number of iterations is chosen automatically, so each repetition runs
+ * at least --bench-time seconds, then the benchmark is repeated and
+ * minimal, median, mean time of one iteration and standard deviation
+ * are reported.
+ *
+ * Only code within BENCHMARK_LOOP is measured. If benchmark has no
+ * BENCHMARK_LOOP, whole benchmark function is one iteration and it is
+ * called repeatedly. Fixtures, setup and teardown functions of the suite,
+ * assertions and attributes work same way as for the TEST (setup and
+ * teardown are called only once for each benchmark).
+ */
+#define BENCHMARK(suite, ...)   _NT_BENCHMARK(suite, __VA_ARGS__)
+
+/* Loop performing measured iterations of the benchmark. */
+#define BENCHMARK_LOOP          _NT_BENCHMARK_LOOP
+
+/* Force the compiler to compute given value (result of the benchmarked
+ * code), even if it is not used anywhere later. */
+#define DO_NOT_OPTIMIZE(value)  _NT_DO_NOT_OPTIMIZE(value)
+
+/* Force the compiler to consider all memory as read and written at this
+ * point, so stores performed by benchmarked code can't be eliminated. */
+#define CLOBBER_MEMORY()        _NT_CLOBBER_MEMORY()
 
 /* Define test fixture type, example:
  *
@@ -226,6 +276,17 @@
 /* This macro allows to check if currently running test failed. */
 #define TEST_FAILED()           _NT_TEST_FAILED()
 
+/* Following macros allow to use assertions in threads spawned by the test
+ * (POSIX only): the test thread takes TEST_CONTEXT() and passes it to the
+ * spawned thread, which calls ATTACH_TEST(context) before any assertion, and
+ * DETACH_TEST() when it's done. Failures in the attached thread fail the test,
+ * output of the thread is printed after the test. REQUIRE, FAIL, SKIP_TEST and
+ * SUCCEED terminate the attached thread (it's detached automatically). All
+ * attached threads must be joined before the test returns. */
+#define TEST_CONTEXT()          _nt_test_context()
+#define ATTACH_TEST(context)    _nt_attach_test(context)
+#define DETACH_TEST()           _nt_detach_test()
+
 
 /* Following macros allows you define mocked function. Test system will provide
  * you definition of the function with specified return type and argument types.
@@ -284,16 +345,26 @@
 
 #ifdef __GNUC__
 #define _NT_UNUSED(var) var __attribute__((unused))
+#define _NT_UNLIKELY(cond) __builtin_expect(!!(cond), 0)
+#define _NT_ATOMIC_INC(ptr) __atomic_fetch_add(ptr, 1, __ATOMIC_RELAXED)
+#define _NT_ATOMIC_GET(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define _NT_ATOMIC_SET(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
 #else
 #define _NT_UNUSED(var) var
+#define _NT_UNLIKELY(cond) (cond)
+#define _NT_ATOMIC_INC(ptr) ((*(ptr))++)
+#define _NT_ATOMIC_GET(ptr) (*(ptr))
+#define _NT_ATOMIC_SET(ptr, val) (*(ptr) = (val))
 #endif
 
 #ifdef __cplusplus
 #define _NT_NULL 0
 #define _NT_BOOL bool
+#define _NT_THREAD_LOCAL thread_local
 #else
 #define _NT_NULL ((void*)0)
 #define _NT_BOOL _Bool
+#define _NT_THREAD_LOCAL _Thread_local
 #endif
 
 /* Note, following macroses will declare _nt_OP_char functions
@@ -457,14 +528,27 @@ enum {
     _NT_NOASSERT = 2
 };
 
+/* Descriptor of the assertion call site: constant data, which is passed
+ * to assertion functions by single pointer. */
+struct _nt_site {
+    const char *name;           /* name of the macro: CHECK, REQUIRE, etc... */
+    const char *file;
+    unsigned line;
+    int flags, narg;
+    const char *op;             /* name of the binary operation */
+    const char *left_expr, *right_expr;
+    unsigned long *hits;        /* number of executions (for --assert-stats) */
+};
+
+/* Nonzero if executions of the assertions must be counted. */
+extern int _nt_count_hits;
+
 /* This macros generates declaration of the function which checks boolean
  * operation, prints assertion if needed, and returns result of the operation. */
 #define _NT_DECL_FUNC(op_name, type)                                                    \
-    int _NT_FUNC(op_name, type)(int dummy,                                              \
-        const char *name, const char *file, unsigned line,                              \
-        const char *op, int flags, int narg,                                            \
-        const char *left_expr,  const _nt_value_t* left_val,  _nt_typeinfo_t left_type, \
-        const char *right_expr, const _nt_value_t* right_val, _nt_typeinfo_t right_type)
+    int _NT_FUNC(op_name, type)(int dummy, const struct _nt_site *site,                 \
+        const _nt_value_t* left_val,  _nt_typeinfo_t left_type,                         \
+        const _nt_value_t* right_val, _nt_typeinfo_t right_type)
 
 /* Forward declaration of all check functions, for all types and binary
  * operations applicatble to scalar arguments. */
@@ -480,9 +564,109 @@ _NT_TYPES(_NT_DECL_ALL_FUNC, dummy)
 #define _NT_DECL_TYPEINFO(type, ...) extern const struct _nt_typeinfo _NT_TYPEINFO(type);
 _NT_TYPES(_NT_DECL_TYPEINFO, dummy)
 
+/* This macros converts value of type val_type, held in _nt_value_t pointed
+ * by val, to the type res_type (both are names listed in _NT_TYPES). Pointers
+ * can't be converted to arithmetic types and vice versa: zero is substituted
+ * in such case (this only happens when pointer is compared with 0). */
+#define _NT_CONV(res_type, val_type, val)                               \
+    (_NT_TYPENAME(res_type))_Generic((_NT_TYPENAME(res_type))0,         \
+        _NT_TYPENAME(any_pointer): _NT_CONV_PTR(val_type, val),         \
+        _NT_TYPENAME(cstring): _NT_CONV_PTR(val_type, val),             \
+        default: _NT_CONV_INT(val_type, val))
+
+#define _NT_CONV_PTR(val_type, val)                 \
+    _Generic((_NT_TYPENAME(val_type))0,             \
+        _NT_TYPENAME(any_pointer): (val)->val_type, \
+        _NT_TYPENAME(cstring): (val)->val_type,     \
+        default: 0)
+
+#define _NT_CONV_INT(val_type, val)                 \
+    _Generic((_NT_TYPENAME(val_type))0,             \
+        _NT_TYPENAME(any_pointer): 0,               \
+        _NT_TYPENAME(cstring): 0,                   \
+        default: (val)->val_type)
+
+/* Enumerate types listed in _NT_TYPES: _nt_tag_TYPE constants allow to
+ * distinguish captured values at compile time (unlike typeinfo pointers,
+ * which can't be compared by the compiler). */
+#define _NT_TAG(type) _NT_CONCAT(_nt_tag_, type)
+#define _NT_DECL_TAG(type, ...) _NT_TAG(type),
+enum { _NT_TYPES(_NT_DECL_TAG, dummy) };
+
+/* Select tag appropriate to type of the given expression. */
+#define _NT_TAG_SEL(type, result, name, ...)  type: _NT_TAG(result),
+#define _NT_SEL_TAG(expr) \
+    _Generic((expr), _NT_TYPEMAP(_NT_TAG_SEL, dummy) default: _NT_TAG(any_pointer))
+
+/* Define functions _nt_load_TYPE, which convert captured assertion argument,
+ * identified by the tag, to the given type. The tag is known at compile time,
+ * so when the function is inlined, whole chain of conditions is reduced
+ * to single conversion. */
+#define _NT_LOAD(type) _NT_CONCAT(_nt_load_, type)
+
+#define _NT_LOAD_CASE(val_type, unused, res_type, val, tag) \
+    tag == _NT_TAG(val_type) ? _NT_CONV(res_type, val_type, val) :
+
+#define _NT_DEF_LOAD(type)                                                      \
+    inline static _NT_TYPENAME(type)                                            \
+    _NT_LOAD(type)(const _nt_value_t *val, int tag) {                           \
+        return _NT_TYPES(_NT_LOAD_CASE, type, val, tag) (_NT_TYPENAME(type))0;  \
+    }
+
+/* Inline assertions rely on _Generic, which C++ lacks. */
+#ifndef __cplusplus
+/* _NT_TYPES can't be used here, as it is used by _NT_DEF_LOAD itself. */
+_NT_DEF_LOAD(Char)
+_NT_DEF_LOAD(signed_char)
+_NT_DEF_LOAD(unsigned_char)
+_NT_DEF_LOAD(any_signed)
+_NT_DEF_LOAD(any_unsigned)
+_NT_DEF_LOAD(any_float)
+_NT_DEF_LOAD(any_pointer)
+_NT_DEF_LOAD(cstring)
+#endif
+
+/* This macros transforms symbolic name of the binary operation and arguments
+ * type name to the name of the inline function, which performs the operation
+ * and calls _nt_OP_TYPE function (see _NT_FUNC) only if the check fails,
+ * so the assertion is printed by the same code. */
+#define _NT_FAST_FUNC(op, type) _NT_CONCAT(_NT_CONCAT(_nt_fast, op), type)
+
+#define _NT_DECL_FAST(op_name, type)                                                    \
+    inline static int _NT_FAST_FUNC(op_name, type)(int dummy,                           \
+        int left_tag, int right_tag, const struct _nt_site *site,                       \
+        const _nt_value_t* left_val,  _nt_typeinfo_t left_type,                         \
+        const _nt_value_t* right_val, _nt_typeinfo_t right_type)
+
+#define _NT_CALL_FUNC(op_name, type)                                                    \
+    _NT_FUNC(op_name, type)(dummy, site, left_val, left_type, right_val, right_type)
+
+/* Scalar operations are performed inline. */
+#define _NT_DEF_FAST(op_name, type)                                             \
+    _NT_DECL_FAST(op_name, type) {                                              \
+        return !!(_NT_LOAD(type)(left_val, left_tag) _NT_OP(op_name)            \
+                    _NT_LOAD(type)(right_val, right_tag)) ^ (site->flags & _NT_NEG_OP) \
+            ? 1 : _NT_CALL_FUNC(op_name, type);                                 \
+    }
+
+/* String operations are always performed by _nt_OP_TYPE functions. */
+#define _NT_DEF_SLOW(op_name, type)                                             \
+    _NT_DECL_FAST(op_name, type) {                                              \
+        (void)left_tag, (void)right_tag;                                        \
+        return _NT_CALL_FUNC(op_name, type);                                    \
+    }
+
+#define _NT_DEF_ALL_FAST(type, ...)         \
+    _NT_BINOPS_SCALAR(_NT_DEF_FAST, type)   \
+    _NT_BINOPS_STRING(_NT_DEF_SLOW, type)
+
+#ifndef __cplusplus
+_NT_TYPES(_NT_DEF_ALL_FAST, dummy)
+#endif
+
 /* Define mapping between all primitive types and corresponding
  * comparator functions. */
-#define _NT_GENERIC(type, result, tname, op) type: _NT_FUNC(op, result),
+#define _NT_GENERIC(type, result, tname, op) type: _NT_FAST_FUNC(op, result),
 
 /* Define mapping between all primitive types and typeinfo structures. */
 #define _NT_TYPE_SEL(type, result, name, ...)  type: &_NT_TYPEINFO(result),
@@ -511,15 +695,48 @@ _NT_DECL_TEMP(const void*, any_pointer, any_pointer, dummy)
 
 #define _NT_GEN_TEMP(type, ctype, tname, ...) type: _NT_TYPE_TEMP_FN(tname),
 
+/* Pointers to descriptors of all assertion sites are placed in the dedicated
+ * section, so the sites, which were never executed, can be found. */
+#ifdef __ELF__
+#define _NT_PLACE_SITE(site)                                        \
+    static const struct _nt_site *const _nt_site_ptr                \
+        __attribute__((section("_nt_section_site_"), used)) = site
+#else
+#define _NT_PLACE_SITE(site) (void)0
+#endif
+
+/* Define the descriptor of the assertion site (in the statement expression,
+ * as static variables can't be defined in an expression), count execution
+ * of the assertion and return address of the descriptor. */
+#ifdef __GNUC__
+#define _NT_SITE(name, left, op, right, flags, narg) __extension__ ({       \
+    static unsigned long _nt_hits;                                          \
+    static const struct _nt_site _nt_site = {                               \
+        name, __FILE__, __LINE__, flags, narg, _NT_OP_NAME(op),             \
+        _NT_STRINGIFY(left), _NT_STRINGIFY(right), &_nt_hits };             \
+    _NT_PLACE_SITE(&_nt_site);                                              \
+    if (_NT_UNLIKELY(_nt_count_hits))                                       \
+        _NT_ATOMIC_INC(&_nt_hits);                                          \
+    &_nt_site; })
+#else
+/* Without statement expressions the descriptor is a compound literal, such
+ * sites aren't known to --assert-stats and their executions aren't counted. */
+#define _NT_SITE(name, left, op, right, flags, narg)                        \
+    (&(const struct _nt_site){                                              \
+        name, __FILE__, __LINE__, flags, narg, _NT_OP_NAME(op),             \
+        _NT_STRINGIFY(left), _NT_STRINGIFY(right), (unsigned long*)0 })
+#endif
+
 /* Generic, type-depending assertyion function. */
 #define _NT_ASSERT(name, left, op, right, flags, narg, continuation) (      \
     _Generic( _NT_EXPR_TYPE((left), (right)),                               \
         _NT_TYPEMAP(_NT_GENERIC, op)                                        \
-        default: _NT_FUNC(op, any_pointer) )                                \
+        default: _NT_FAST_FUNC(op, any_pointer) )                           \
            (sizeof((left) _NT_OP(op) (right)),                              \
-            name, __FILE__, __LINE__, _NT_OP_NAME(op), flags, narg,         \
-            _NT_STRINGIFY(left), _NT_MAKETEMP(left), _NT_SEL_TYPE(left),    \
-            _NT_STRINGIFY(right), _NT_MAKETEMP(right), _NT_SEL_TYPE(right)) \
+            _NT_SEL_TAG(left), _NT_SEL_TAG(right),                          \
+            _NT_SITE(name, left, op, right, flags, narg),                   \
+            _NT_MAKETEMP(left), _NT_SEL_TYPE(left),                         \
+            _NT_MAKETEMP(right), _NT_SEL_TYPE(right))                       \
                 ? 1 : (_nt_trap(), continuation, 0))
 
 /* Function at which breakpoint can be set. */
@@ -559,6 +776,12 @@ void _nt_scope_reset(void);
 
 #define _NT_TEST_FAILED()       _nt_is_fail()
 
+int _nt_is_fail(void);
+
+void *_nt_test_context(void);
+void _nt_attach_test(void *context);
+void _nt_detach_test(void);
+
 #define _NT_INFO(...)   \
     _nt_info(_NT_UNIQ_LIT(), __FILE__, __LINE__, \
         _NT_NARGS(__VA_ARGS__) _NT_FOREACH(_NT_VALUE, dummy, __VA_ARGS__))
@@ -617,9 +840,30 @@ void _nt_scope_reset(void);
 #define _NT_REGISTER_SIG(prefix, name) \
     static __attribute__((constructor)) void _NT_CONCAT(prefix, name)(void)
 
-/* Create name of the function implementing particular test. */
-#define _NT_TEST_FUNC(suite, name) _NT_CONCAT(_nt_test_, _NT_TEST_NAME(suite, name))
-#define _NT_RUNNER_FUNC(suite, name)  _NT_CONCAT(_nt_runner_, _NT_TEST_NAME(suite, name))
+/* If _NT_USE_SECTIONS is defined to 1, tests and fixtures are not
+ * registered by constructors: constant descriptors are placed in dedicated
+ * sections (one section for each kind of descriptors), and the test runner
+ * finds them via __start_SECTION and __stop_SECTION symbols, which are
+ * defined by the linker. So nothing is executed at startup. */
+#if _NT_USE_SECTIONS
+#ifndef __ELF__
+#error "_NT_USE_SECTIONS requires ELF object format"
+#endif
+
+#define _NT_SECTION(kind) _NT_CONCAT(_nt_section_, kind)
+
+/* Place pointer to the descriptor to the section for given kind of descriptors. */
+#define _NT_PLACE(kind, type, name, ptr)                            \
+    static type *const _NT_CONCAT(_nt_place_, name)                 \
+        __attribute__((section(_NT_STRINGIFY(_NT_SECTION(kind))), used)) = ptr
+#endif
+
+/* Create name of the function implementing particular test or benchmark
+ * (kind is a prefix "test_" or "bench_"). */
+#define _NT_TEST_FUNC(kind, suite, name) \
+    _NT_CONCAT(_NT_CONCAT(_nt_, kind), _NT_TEST_NAME(suite, name))
+#define _NT_RUNNER_FUNC(kind, suite, name) \
+    _NT_CONCAT(_NT_CONCAT(_nt_runner_, kind), _NT_TEST_NAME(suite, name))
 
 /* Generate signature of the function which performs the test. */
 #define _NT_SETUP_FUNC(suite)       _NT_CONCAT(_nt_setup_, suite)
@@ -640,60 +884,103 @@ struct _nt_suite {
     struct _nt_suite *next;
 };
 
-struct _nt_scope_msg;
-
-struct _nt_fail_info {
-    const char *fail_file;
-    unsigned fail_line;
-    char *fail_msg;
+/* Optional attributes of the test (see TEST macro), first member is only
+ * placeholder allowing to initialize the structure with empty attributes. */
+struct _nt_test_attr {
+    int dummy;
+    double timeout;
 };
+
+/* Test descriptor, all the state of running test is kept separately
+ * (in thread local context), so same test can be run by any thread. */
 struct _nt_test {
     const char *const file;
     const unsigned line;
     void (*const func)(_nt_fixture_tag *);
     const char *const name;
-    void *jmpbuf;
     const struct _nt_suite *suite;
-    _nt_fixture_tag *fixture;
-    struct _nt_scope_msg *scope_msg;
-    struct _nt_fail_info first, last;
+    const struct _nt_test_attr attr;
     struct _nt_test *next;
 };
 
 void _nt_register_test(struct _nt_test *);
 
+void _nt_register_benchmark(struct _nt_test *);
+
 const struct _nt_suite* _nt_setup_suite(struct _nt_suite *suite);
 
 #define _NT_GET_FIXTURE()   (0 ? _fixture : _fixture)
 
-/* Define test function. 
+/* Define test function, optional attributes of the test follow the name.
  * TODO: pass fixture to each test. */
-#define _NT_TEST(Suite, Name)                                               \
-    struct _NT_FIXTURE(Suite);                                              \
-    static void _NT_TEST_FUNC(Suite, Name)(struct _NT_FIXTURE(Suite) *);    \
-    static void _NT_RUNNER_FUNC(Suite, Name)(_nt_fixture_tag *fixture) {    \
-        _NT_TEST_FUNC(Suite, Name)((struct _NT_FIXTURE(Suite)*)fixture);    \
-    }                                                                       \
-    _NT_REGISTER_SIG(_nt_register_test_, _NT_TEST_NAME(Suite, Name)) {      \
-        static struct _nt_suite smem = {                                    \
-            _NT_STRINGIFY(Suite), 0, _NT_NULL, _NT_NULL, _NT_NULL           \
-        };                                                                  \
-        const struct _nt_suite *s_ptr = _nt_setup_suite(&smem);             \
-        static struct _nt_test test = {                                     \
-            __FILE__, __LINE__,                                             \
-            _NT_RUNNER_FUNC(Suite, Name),				    \
-            _NT_STRINGIFY(Suite) "/" _NT_STRINGIFY(Name),                   \
-            _NT_NULL, _NT_NULL, _NT_NULL, _NT_NULL,                         \
-            {_NT_NULL, 0, _NT_NULL},                                        \
-            {_NT_NULL, 0, _NT_NULL},                                        \
-            _NT_NULL                                                        \
-        };                                                                  \
-        test.suite = s_ptr;                                                 \
-        _nt_register_test(&test);                                           \
-    }                                                                       \
-    static void _NT_TEST_FUNC(Suite, Name)                                  \
+#define _NT_TEST(Suite, ...) \
+    _NT_TEST_ATTR(test_, _nt_register_test, Suite, __VA_ARGS__,)
+
+/* Benchmark is registered same way as the test, but in separate list. */
+#define _NT_BENCHMARK(Suite, ...) \
+    _NT_TEST_ATTR(bench_, _nt_register_benchmark, Suite, __VA_ARGS__,)
+
+#define _NT_TEST_ATTR(Kind, Register, Suite, Name, ...)                         \
+    struct _NT_FIXTURE(Suite);                                                  \
+    static void _NT_TEST_FUNC(Kind, Suite, Name)(struct _NT_FIXTURE(Suite) *);  \
+    static void _NT_RUNNER_FUNC(Kind, Suite, Name)(_nt_fixture_tag *fixture) {  \
+        _NT_TEST_FUNC(Kind, Suite, Name)((struct _NT_FIXTURE(Suite)*)fixture);  \
+    }                                                                           \
+    _NT_TEST_REGISTER(Kind, Register, Suite, Name, __VA_ARGS__)                 \
+    static void _NT_TEST_FUNC(Kind, Suite, Name)                                \
                 (struct _NT_FIXTURE(Suite) *_NT_UNUSED(_fixture))
 
+#if !_NT_USE_SECTIONS
+#define _NT_TEST_REGISTER(Kind, Register, Suite, Name, ...)                     \
+    _NT_REGISTER_SIG(_NT_CONCAT(_nt_register_, Kind), _NT_TEST_NAME(Suite, Name)) { \
+        static struct _nt_suite smem = {                                        \
+            _NT_STRINGIFY(Suite), 0, _NT_NULL, _NT_NULL, _NT_NULL               \
+        };                                                                      \
+        const struct _nt_suite *s_ptr = _nt_setup_suite(&smem);                 \
+        static struct _nt_test test = {                                         \
+            __FILE__, __LINE__,                                                 \
+            _NT_RUNNER_FUNC(Kind, Suite, Name),                                 \
+            _NT_STRINGIFY(Suite) "/" _NT_STRINGIFY(Name),                       \
+            _NT_NULL, {0, __VA_ARGS__}, _NT_NULL                                \
+        };                                                                      \
+        test.suite = s_ptr;                                                     \
+        Register(&test);                                                        \
+    }
+#else
+/* Test refers to the suite descriptor, which has only the name of the suite,
+ * the runner finds setup, teardown functions and fixture size by the name. */
+#define _NT_TEST_REGISTER(Kind, Register, Suite, Name, ...)                     \
+    static const struct _nt_suite                                               \
+        _NT_CONCAT(_nt_suite_, _NT_TEST_FUNC(Kind, Suite, Name)) = {            \
+            _NT_STRINGIFY(Suite), 0, _NT_NULL, _NT_NULL, _NT_NULL               \
+        };                                                                      \
+    static const struct _nt_test                                                \
+        _NT_CONCAT(_nt_desc_, _NT_TEST_FUNC(Kind, Suite, Name)) = {             \
+            __FILE__, __LINE__,                                                 \
+            _NT_RUNNER_FUNC(Kind, Suite, Name),                                 \
+            _NT_STRINGIFY(Suite) "/" _NT_STRINGIFY(Name),                       \
+            &_NT_CONCAT(_nt_suite_, _NT_TEST_FUNC(Kind, Suite, Name)),          \
+            {0, __VA_ARGS__}, _NT_NULL                                          \
+        };                                                                      \
+    _NT_PLACE(Kind, const struct _nt_test, _NT_TEST_FUNC(Kind, Suite, Name),    \
+        &_NT_CONCAT(_nt_desc_, _NT_TEST_FUNC(Kind, Suite, Name)));
+#endif
+
+/* Loop counter is kept in the benchmark function itself, so the overhead
+ * of each iteration is only decrement and comparison. Time measurement
+ * starts when the loop is entered and stops when the loop is finished. */
+#define _NT_BENCHMARK_LOOP                                              \
+    for (unsigned long long _nt_iter = _nt_bench_begin();               \
+            _nt_iter || (_nt_bench_end(), 0); --_nt_iter)
+
+unsigned long long _nt_bench_begin(void);
+
+void _nt_bench_end(void);
+
+#define _NT_DO_NOT_OPTIMIZE(value)  __asm__ __volatile__("" : : "r,m"(value) : "memory")
+
+#define _NT_CLOBBER_MEMORY()        __asm__ __volatile__("" : : : "memory")
+
 
 #define _NT_FIXTURE_TEMPLATE(suite, prefix, helper, func, setup, teardown)  \
     struct _NT_FIXTURE(suite);                                              \
@@ -701,6 +988,11 @@ const struct _nt_suite* _nt_setup_suite(struct _nt_suite *suite);
     static void helper(_nt_fixture_tag *ptr) {                              \
         func((struct _NT_FIXTURE(suite)*)ptr);                              \
     }                                                                       \
+    _NT_FIXTURE_REGISTER(suite, prefix, setup, teardown)                    \
+    static void func(struct _NT_FIXTURE(suite) *_fixture)
+
+#if !_NT_USE_SECTIONS
+#define _NT_FIXTURE_REGISTER(suite, prefix, setup, teardown)                \
     _NT_REGISTER_SIG(prefix, suite) {                                       \
         static struct _nt_suite var = {                                     \
             _NT_STRINGIFY(suite),                                           \
@@ -708,8 +1000,17 @@ const struct _nt_suite* _nt_setup_suite(struct _nt_suite *suite);
             setup, teardown, _NT_NULL                                       \
         };                                                                  \
         _nt_setup_suite(&var);                                              \
-    }                                                                       \
-    static void func(struct _NT_FIXTURE(suite) *_fixture)
+    }
+#else
+#define _NT_FIXTURE_REGISTER(suite, prefix, setup, teardown)                \
+    static const struct _nt_suite _NT_CONCAT(prefix, suite) = {             \
+        _NT_STRINGIFY(suite),                                               \
+        sizeof(struct _NT_FIXTURE(suite)),                                  \
+        setup, teardown, _NT_NULL                                           \
+    };                                                                      \
+    _NT_PLACE(suite_, const struct _nt_suite, _NT_CONCAT(prefix, suite),    \
+        &_NT_CONCAT(prefix, suite));
+#endif
 
 
 #define _NT_TEST_SETUP(suite) \
@@ -789,15 +1090,35 @@ const struct _nt_suite* _nt_setup_suite(struct _nt_suite *suite);
 #define _NT_MOCK_TYPE(func) struct _NT_CONCAT(_nt_mock_type_, func)
 #define _NT_MOCK(func) (_NT_CONCAT(_nt_mock_get_, func)())
 
-struct _nt_mock {
-    void (*const func)(void);
-    struct _nt_mock *next;
+/* Entry of the mocked function in the thread: `state` is the storage of the
+ * mock in this thread, `mock` is the state used by the thread (own state, or
+ * state shared by the test), which is valid while `scope` is _nt_mock_scope.
+ * The state is reset lazily, when it's used first time in the new scope. */
+struct _nt_mock_entry {
+    const void *key;
+    unsigned size;
+    struct _nt_mock_entry *next;    /* next entry in the table of the test */
+    void *state;
+    unsigned long generation;       /* scope in which the state was reset */
+    void *mock;
+    unsigned long scope;
 };
 
-void _nt_register_mock(struct _nt_mock *);
+/* Scope of the mock states used by current thread: it is changed when the
+ * thread starts each test, or is attached to the test. */
+extern _NT_THREAD_LOCAL unsigned long _nt_mock_scope;
+
+/* Mock states might be used by other threads (some test gave out its context
+ * with TEST_CONTEXT(), or a thread, which doesn't run tests, called a mock),
+ * so the call counter must be updated atomically. */
+extern int _nt_mock_shared;
 
-/* Arguments must be function argument types.
- * TODO reset all mocks at end of each tests. */
+void *_nt_mock_lookup(struct _nt_mock_entry *entry, void *state);
+
+/* Arguments must be function argument types. Mock state belongs to the test
+ * (threads attached to the test share it), so tests running in parallel
+ * threads don't interfere with each other. Mock state is reset on first
+ * call in each test. */
 #define _NT_MOCK_ANY_FUNCTION(Real, Wrap, Result, Func, ...)        \
     _NT_MOCK_TYPE(Func) {                                           \
             unsigned long count;                                    \
@@ -808,15 +1129,22 @@ void _nt_register_mock(struct _nt_mock *);
             };                                                      \
     };                                                              \
     _NT_MOCK_TYPE(Func) *_NT_CONCAT(_nt_mock_get_, Func)(void) {    \
-        static _NT_MOCK_TYPE(Func) mock = {0, _NT_NULL, {0}};       \
-        return &mock;                                               \
+        static const char key = 0;                                  \
+        static _NT_THREAD_LOCAL struct {                            \
+            struct _nt_mock_entry entry;                            \
+            _NT_MOCK_TYPE(Func) state;                              \
+        } own = {{&key, sizeof(_NT_MOCK_TYPE(Func)), _NT_NULL,      \
+                    _NT_NULL, 0, _NT_NULL, 0}, {0, _NT_NULL, {0}}}; \
+        if (_NT_UNLIKELY(own.entry.scope != _nt_mock_scope))        \
+            return (_NT_MOCK_TYPE(Func)*)_nt_mock_lookup(&own.entry, &own.state); \
+        return (_NT_MOCK_TYPE(Func)*)own.entry.mock;                \
     }                                                               \
     void _NT_CONCAT(_nt_mock_reset_, Func)(void) {                  \
         static const _NT_MOCK_TYPE(Func) init = {0, _NT_NULL, {0}}; \
         *_NT_MOCK(Func) = init;                                     \
     }                                                               \
     unsigned long _NT_CONCAT(_nt_mock_count_, Func)(void) {         \
-        return _NT_MOCK(Func)->count;                               \
+        return _NT_ATOMIC_GET(&_NT_MOCK(Func)->count);              \
     }                                                               \
     Result Real(__VA_ARGS__);                                       \
     Result _NT_CONCAT(_nt_fake_, Func)(_NT_MOCK_DECL(__VA_ARGS__)){ \
@@ -826,16 +1154,12 @@ void _nt_register_mock(struct _nt_mock *);
     Result Wrap(_NT_MOCK_DECL(__VA_ARGS__))                         \
     {                                                               \
         _NT_MOCK_TYPE(Func) *mock = _NT_MOCK(Func);                 \
-        mock->count++;                                              \
-        return (mock->func ? mock->func : Real)                     \
-                    (_NT_MOCK_ARGS(__VA_ARGS__));                   \
-    }                                                               \
-    _NT_REGISTER_SIG(_nt_register_mock_, Func) {                    \
-        static struct _nt_mock mock = {                             \
-            _NT_CONCAT(_nt_mock_reset_, Func),                      \
-            _NT_NULL                                                \
-        };                                                          \
-        _nt_register_mock(&mock);                                   \
+        Result (*func)(__VA_ARGS__) = _NT_ATOMIC_GET(&mock->func);  \
+        if (_NT_UNLIKELY(_NT_ATOMIC_GET(&_nt_mock_shared)))         \
+            _NT_ATOMIC_INC(&mock->count);                           \
+        else                                                        \
+            mock->count++;                                          \
+        return (func ? func : Real)(_NT_MOCK_ARGS(__VA_ARGS__));    \
     }
 
 #define _NT_MOCK_FUNCTION(result, func, ...) \
@@ -851,9 +1175,9 @@ void _nt_register_mock(struct _nt_mock *);
 #define _NT_MOCK_COUNT(func) _NT_CONCAT(_nt_mock_count_, func)()
 
 #define _NT_MOCK_SET_RESULT(Func, val) \
-    (_NT_MOCK(Func)->func = _NT_CONCAT(_nt_fake_, Func), _NT_MOCK(Func)->result = (val))
+    (_NT_MOCK(Func)->result = (val), _NT_ATOMIC_SET(&_NT_MOCK(Func)->func, _NT_CONCAT(_nt_fake_, Func)))
 
-#define _NT_MOCK_SET_FUNC(Func, func_ptr) (_NT_MOCK(Func)->func = (func_ptr))
+#define _NT_MOCK_SET_FUNC(Func, func_ptr) _NT_ATOMIC_SET(&_NT_MOCK(Func)->func, (func_ptr))
 
 
 #define _NT_FOREACH(F, param, ...) \